@@ -1,3 +1,5 @@
+#include <stdarg.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -7,11 +9,21 @@
 #include "net/nanocoap.h"
 #include "hashes/sha256.h"
 #include "kernel_defines.h"
-
-#include "edsign.h"
-#include "ed25519.h"
+#include "panic.h"
+#include "mutex.h"
+#include "msg.h"
+#include "thread.h"
+#include "xtimer.h"
+#include "byteorder.h"
+
+#if IS_USED(MODULE_MALLOC_MONITOR)
+#include "malloc_monitor.h"
+#endif
+
+#include "did_crypto.h"
 #include "random.h"
 #include "base64.h"
+#include "nanocbor/nanocbor.h"
 
 //DID PROOF -----------------------------------------------------
 typedef struct {
@@ -59,6 +71,199 @@ typedef struct {
 //----------------------------------------------------------------
 static did* deviceDid = NULL; //DEVICE DID
 //----------------------------------------------------------------
+
+did* createDeviceDid(void);
+
+//JSON TEMPLATES -------------------------------------------------
+/* Every DID this device creates is Ed25519 with the same constant fields in the
+ * same order, so its JSON is a fixed template: the literals below with slots
+ * for the key material, id, timestamps and signatures in between. The slots
+ * have fixed lengths for Ed25519 (only the timestamps are bounded), which
+ * gives the size of every serialization at compile time. */
+#define DID_KTY                 "OKP"
+#define DID_CRV                 "Ed25519"
+#define DID_ALG                 "EdDSA"
+#define DID_ATTESTATION_ID      "#key1"
+#define DID_ATTESTATION_TYPE    "JsonWebKey2020"
+#define DID_ID_PREFIX           "did:self:"
+
+#define LITERAL_LEN(lit)        (sizeof(lit) - 1)
+#define BASE64URL_LEN(n)        (((n) * 4 + 2) / 3) //WITHOUT PADDING
+
+#define DID_KEY_BASE64_LEN          BASE64URL_LEN(DID_CRYPTO_PUBLIC_KEY_SIZE)
+#define DID_SIGNATURE_BASE64_LEN    BASE64URL_LEN(DID_CRYPTO_SIGNATURE_SIZE)
+#define DID_HASH_BASE64_LEN         BASE64URL_LEN(SHA256_DIGEST_LENGTH)
+#define DID_ID_LEN                  (LITERAL_LEN(DID_ID_PREFIX) + DID_HASH_BASE64_LEN)
+#define DID_TIMESTAMP_MAX_LEN       (20U) //DECIMAL OF A 64 BIT time_t
+
+#define JWK_JSON_HEAD           "{\"kty\":\"" DID_KTY "\",\"crv\":\"" DID_CRV "\",\"x\":\""
+#define JWK_THUMBPRINT_HEAD     "{\"crv\":\"" DID_CRV "\",\"kty\":\"" DID_KTY "\",\"x\":\""
+#define JWK_JSON_TAIL           "\"}"
+#define JWK_JSON_LEN            (LITERAL_LEN(JWK_JSON_HEAD) + DID_KEY_BASE64_LEN + LITERAL_LEN(JWK_JSON_TAIL))
+
+#define HEADER_JSON_HEAD        "{\"alg\":\"" DID_ALG "\",\"jwk\":"
+#define HEADER_JSON_LEN         (LITERAL_LEN(HEADER_JSON_HEAD) + JWK_JSON_LEN + 1)
+
+#define PAYLOAD_JSON_MAX_LEN    (LITERAL_LEN("{\"iat\":,\"exp\":,\"s256\":\"\"}") + 2 * DID_TIMESTAMP_MAX_LEN + DID_HASH_BASE64_LEN)
+
+#define PROOF_JSON_MAX_LEN      (LITERAL_LEN("{\"header\":,\"payload\":,\"signature\":\"\"}") + HEADER_JSON_LEN + \
+                                 PAYLOAD_JSON_MAX_LEN + DID_SIGNATURE_BASE64_LEN)
+
+#define ATTESTATION_JSON_HEAD   "{\"id\":\"" DID_ATTESTATION_ID "\",\"type\":\"" DID_ATTESTATION_TYPE "\",\"publicKeyJwk\":"
+#define ATTESTATION_JSON_LEN    (LITERAL_LEN(ATTESTATION_JSON_HEAD) + JWK_JSON_LEN + 1)
+
+#define DOCUMENT_JSON_LEN       (LITERAL_LEN("{\"id\":\"\",\"attestation\":}") + DID_ID_LEN + ATTESTATION_JSON_LEN)
+
+/* "header_base64url.payload_base64url" */
+#define SIGNING_INPUT_MAX_LEN   (BASE64URL_LEN(HEADER_JSON_LEN) + 1 + BASE64URL_LEN(PAYLOAD_JSON_MAX_LEN))
+/* "document_base64url signing_input.signature" */
+#define DID_TEXT_MAX_LEN        (BASE64URL_LEN(DOCUMENT_JSON_LEN) + 1 + SIGNING_INPUT_MAX_LEN + 1 + DID_SIGNATURE_BASE64_LEN)
+//----------------------------------------------------------------
+
+//PRECOMPUTED RESPONSES ------------------------------------------
+/* The DID only changes in createDeviceDid, so every representation served by
+ * the DID resources is serialized once per DID generation and then replied
+ * from these buffers as is. Text buffers are sized by the JSON templates. */
+#define DID_RESPONSE_BUF_SIZE           (DID_TEXT_MAX_LEN + 1)
+#define DID_DOCUMENT_RESPONSE_BUF_SIZE  (DOCUMENT_JSON_LEN + 1)
+#define DID_PROOF_RESPONSE_BUF_SIZE     (PROOF_JSON_MAX_LEN + 1)
+
+static char did_response[DID_RESPONSE_BUF_SIZE]; //"document_base64url proof_base64url"
+static size_t did_response_len = 0;
+
+static char did_document_response[DID_DOCUMENT_RESPONSE_BUF_SIZE]; //DID DOCUMENT JSON
+static size_t did_document_response_len = 0;
+
+static char did_proof_response[DID_PROOF_RESPONSE_BUF_SIZE]; //DID PROOF JSON
+static size_t did_proof_response_len = 0;
+
+/* CBOR (content-format 60) representations of the same DID */
+#ifndef DID_CBOR_RESPONSE_BUF_SIZE
+#define DID_CBOR_RESPONSE_BUF_SIZE  (512U)
+#endif
+
+static uint8_t did_cbor_response[DID_CBOR_RESPONSE_BUF_SIZE]; //[document, proof]
+static size_t did_cbor_response_len = 0;
+
+static uint8_t did_document_cbor_response[DID_CBOR_RESPONSE_BUF_SIZE / 2];
+static size_t did_document_cbor_response_len = 0;
+
+static uint8_t did_proof_cbor_response[DID_CBOR_RESPONSE_BUF_SIZE / 2];
+static size_t did_proof_cbor_response_len = 0;
+
+/* ETag of the DID representations: the first DID_ETAG_HASH_SIZE bytes of the
+ * s256 hash of the DID document, then one byte for the resource and one for the
+ * content format. A new DID generation has new keys, so a new s256. */
+#define DID_ETAG_HASH_SIZE  (6U)
+#define DID_ETAG_SIZE       (DID_ETAG_HASH_SIZE + 2)
+
+#define DID_ETAG_DID        ('d')
+#define DID_ETAG_DOCUMENT   ('D')
+#define DID_ETAG_PROOF      ('p')
+
+static uint8_t did_etag_hash[DID_ETAG_HASH_SIZE];
+
+/* Readings of /riot/data signed together under one Merkle root (0: every
+ * reading is signed on its own). A power of two up to 256. */
+#ifndef CONFIG_DID_DATA_EPOCH_SIZE
+#define CONFIG_DID_DATA_EPOCH_SIZE      (0U)
+#endif
+
+#if (CONFIG_DID_DATA_EPOCH_SIZE > 256) || (CONFIG_DID_DATA_EPOCH_SIZE & (CONFIG_DID_DATA_EPOCH_SIZE - 1))
+#error "CONFIG_DID_DATA_EPOCH_SIZE must be 0 or a power of two up to 256"
+#endif
+
+#define DATA_EPOCH_LEAVES   (CONFIG_DID_DATA_EPOCH_SIZE > 0 ? CONFIG_DID_DATA_EPOCH_SIZE : 1)
+#define DATA_EPOCH_DEPTH    ((DATA_EPOCH_LEAVES > 128) ? 8 : (DATA_EPOCH_LEAVES > 64) ? 7 : \
+                             (DATA_EPOCH_LEAVES > 32) ? 6 : (DATA_EPOCH_LEAVES > 16) ? 5 : \
+                             (DATA_EPOCH_LEAVES > 8) ? 4 : (DATA_EPOCH_LEAVES > 4) ? 3 : \
+                             (DATA_EPOCH_LEAVES > 2) ? 2 : (DATA_EPOCH_LEAVES > 1) ? 1 : 0)
+#define DATA_EPOCH_PATH_SIZE    (DATA_EPOCH_DEPTH * SHA256_DIGEST_LENGTH)
+/* "index.path_base64url." in front of the root signature */
+#define DATA_EPOCH_PROOF_SIZE   ((DATA_EPOCH_PATH_SIZE + 2) / 3 * 4 + 8)
+
+/* Base64url JSON of a reading, NULL terminated */
+#define DATA_READING_BASE64_SIZE    (96U)
+
+/* Last signed reading of /riot/data, kept so all blocks of one reply match */
+static char data_response[DID_RESPONSE_BUF_SIZE + 1 + DATA_READING_BASE64_SIZE + DATA_EPOCH_PROOF_SIZE +
+                          DID_SIGNATURE_BASE64_LEN]; //"did_response data_base64url.signature"
+static size_t data_response_len = 0;
+
+static uint8_t data_cbor_response[DID_CBOR_RESPONSE_BUF_SIZE + 100 + DATA_EPOCH_PATH_SIZE]; //[document, proof, data]
+static size_t data_cbor_response_len = 0;
+
+/* ETag of a stored /riot/data reading: the number of the reading, then the
+ * content format. Blocks of one reading carry the same ETag, so a client can
+ * tell when the buffer was signed over by another request in between. */
+#define DATA_ETAG_SIZE      (5U)
+
+static uint32_t data_readings;      //READINGS STORED, RANDOM START SO A REBOOT DOES NOT REPEAT ETAGS
+static uint32_t data_response_tag;
+static uint32_t data_cbor_response_tag;
+static uint32_t data_cose_response_tag;
+//----------------------------------------------------------------
+
+//DID ARENAS -----------------------------------------------------
+/* A DID generation (key pairs, DID graph and its strings) lives in one arena.
+ * The next generation is built in the spare arena while the current one keeps
+ * serving, and the retired generation is torn down with a single reset. */
+#ifndef DID_ARENA_SIZE
+#define DID_ARENA_SIZE  (1024U)
+#endif
+
+typedef struct {
+    uint8_t buf[DID_ARENA_SIZE];
+    size_t used;
+} did_arena;
+
+static did_arena did_arenas[2];
+static did_arena* current_arena = &did_arenas[0]; //ARENA OF THE SERVED DID
+static did_arena* next_arena = &did_arenas[1]; //ARENA THE NEXT DID IS BUILT IN
+
+/** @brief  Allocate zeroed memory from an arena
+* @param[in] arena arena to allocate from
+* @param[in] size number of bytes
+* @returns pointer to memory, panics if the arena is exhausted
+*/
+void* arenaAlloc(did_arena* arena, size_t size){
+    size_t start = (arena->used + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+
+    if (start + size > sizeof(arena->buf)) {
+        core_panic(PANIC_GENERAL_ERROR, "DID arena exhausted, increase DID_ARENA_SIZE");
+    }
+
+    arena->used = start + size;
+    return &arena->buf[start];
+}
+
+char* arenaStrdup(did_arena* arena, const char* str){
+    size_t len = strlen(str);
+    char* copy = arenaAlloc(arena, len + 1);
+    memcpy(copy, str, len);
+    return copy;
+}
+
+/** @brief  Release everything allocated from an arena at once
+* @param[in] arena arena to reset, wiped so no secret keys are left behind
+*/
+void arenaReset(did_arena* arena){
+    memset(arena->buf, 0, arena->used);
+    arena->used = 0;
+}
+
+/** @brief  Find the arena a DID generation was allocated in
+* @param[in] ptr pointer into a DID generation
+* @returns arena containing ptr
+*/
+static did_arena* arenaOf(const void* ptr){
+    const uint8_t* p = ptr;
+
+    if (p >= did_arenas[0].buf && p < did_arenas[0].buf + sizeof(did_arenas[0].buf)) {
+        return &did_arenas[0];
+    }
+    return &did_arenas[1];
+}
 //----------------------------------------------------------------
 
 // ----------------------------------------------------------------
@@ -70,30 +275,13 @@ static did* deviceDid = NULL; //DEVICE DID
 * @returns      size of base64 string
  */
 size_t bytes_to_base64url(void* in_bytes, size_t in_bytes_size, void* out_base64url) {
-    size_t size;
+    size_t size = base64_estimate_encode_size(in_bytes_size); //CALLERS PROVIDE AT LEAST THIS MUCH
 
     base64url_encode(in_bytes, in_bytes_size, out_base64url, &size); // convert bytes to base64url
 
     return size;
 }
 
-/** @brief   Hash string with SHA256
- * @param[in]   str     String to hash
- * @returns returns bytes of hash
- */
-uint8_t* hashSH256(char *str)
-{
-    uint8_t* digest = calloc(SHA256_DIGEST_LENGTH, sizeof(uint8_t));
-    sha256(str, strlen(str), digest);
-    
-    char* hash = calloc(SHA256_DIGEST_LENGTH*2, sizeof(char));
-    for (int i = 0; i < SHA256_DIGEST_LENGTH; i++) {
-        sprintf(hash + (i * 2), "%02x", digest[i]);
-    }
-    printf("\nHash: %s\n", hash);
-
-    return digest;
-}
 //----------------------------------------------------------------
 
 typedef struct {
@@ -101,6 +289,7 @@ typedef struct {
     uint8_t* public_key_bytes;
     char* secret_key_base64;
     char* public_key_base64;
+    did_sign_context* signer;   //KEY AS THE CRYPTO BACKEND SIGNS WITH IT
 } key_pair;
 
 /* digital signature key pair PROOF JWK*/ /* Generated using ed25519-genkeypair */
@@ -112,213 +301,727 @@ static key_pair* document_key_pair = NULL;
 
 //----------------------------------------------------------------
 
+// SIGNING ENGINE -------------------------------------------------
+// Signatures are written into caller storage. Verify-after-sign is a
+// self-test only: at boot (didSignSelfTest) and, with
+// CONFIG_DID_SIGN_SELFTEST_INTERVAL set to N, for one in N signatures.
+
+#ifndef CONFIG_DID_SIGN_SELFTEST_INTERVAL
+#define CONFIG_DID_SIGN_SELFTEST_INTERVAL   (0U)
+#endif
+
+/* base64url of a signature, NULL terminated */
+#define SIGNATURE_BASE64_SIZE   (DID_CRYPTO_SIGNATURE_SIZE * 4 / 3 + 4)
+
+typedef struct {
+    uint32_t signatures;    //SIGNATURES MADE
+    uint32_t self_checks;   //SIGNATURES VERIFIED AFTER SIGNING
+    uint32_t failed;        //SELF-CHECKS THAT DID NOT VERIFY
+} sign_stats;
+
+static sign_stats signStats;
+
+/** @brief  Verify a signature that was just made and count the result
+* @returns true if the signature verifies
+*/
+static bool signSelfCheck(const uint8_t* signature, const uint8_t* message, size_t message_len, const uint8_t* public_key){
+    signStats.self_checks++;
+
+    if (!didCryptoVerify(signature, public_key, message, message_len)) {
+        signStats.failed++;
+        printf("SIGNATURE SELF-CHECK FAILED (%lu of %lu)\n", (unsigned long)signStats.failed, (unsigned long)signStats.self_checks);
+        return false;
+    }
+    return true;
+}
+
+/** @brief  Sign message with private key
+* @param[out] signature DID_CRYPTO_SIGNATURE_SIZE bytes of signature
+* @param[in] message to sign
+* @param[in] message_len length of message
+* @param[in] signer signing context of the key pair
+*/
+void sign_message_bytes(uint8_t* signature, const uint8_t* message, size_t message_len, const did_sign_context* signer) {
+    didCryptoSign(signature, signer, message, message_len);
+    signStats.signatures++;
+
+    if (CONFIG_DID_SIGN_SELFTEST_INTERVAL > 0 && signStats.signatures % CONFIG_DID_SIGN_SELFTEST_INTERVAL == 0) {
+        signSelfCheck(signature, message, message_len, signer->public_key);
+    }
+}
+
 /** @brief  Sign message with private key
+* @param[out] signature_base64 SIGNATURE_BASE64_SIZE bytes for the signature as base64url, NULL terminated
 * @param[in] message to sign
 * @param[in] message_len length of message
-* @param[in] secret_key secret key
-* @param[in] public_key public key
-* @returns signature of message in base64
+* @param[in] signer signing context of the key pair
+* @returns length of signature_base64
 */
-char* sign_message(uint8_t* message, uint16_t message_len, uint8_t* secret_key, uint8_t* public_key) {
-    uint8_t* signature = calloc(EDSIGN_SIGNATURE_SIZE, sizeof(uint8_t));
+size_t sign_message(char* signature_base64, const uint8_t* message, size_t message_len, const did_sign_context* signer) {
+    uint8_t signature[DID_CRYPTO_SIGNATURE_SIZE];
+
+    sign_message_bytes(signature, message, message_len, signer);
+
+    size_t size = bytes_to_base64url(signature, DID_CRYPTO_SIGNATURE_SIZE, signature_base64);
+    signature_base64[size] = '\0';
+
+    return size;
+}
 
-    //Sign message
-    edsign_sign(signature, public_key, secret_key, message, message_len);
+/** @brief  Boot self-test of the signing engine
+* Runs the known answer test of the crypto backend, then signs a message
+* longer than one SHA-512 block with a fresh key and checks the signature
+* verifies and that a modified one does not.
+* @returns 0 on success, -1 if the self-test failed
+*/
+int didSignSelfTest(void) {
+    uint8_t long_message[300];     //PAST TWO SHA-512 BLOCKS
+    uint8_t secret_key[DID_CRYPTO_SECRET_KEY_SIZE];
+    uint8_t public_key[DID_CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t signature[DID_CRYPTO_SIGNATURE_SIZE];
+    did_sign_context ctx;
+
+    bool known = didCryptoSelfTest() == 0;
+    if (!known) {
+        signStats.failed++;
+        printf("%s FAILED THE RFC 8032 TEST VECTOR\n", didCryptoBackend());
+    }
 
-    //CHECK WITH VERIFY IF SIGN WORKED (MUST BE NOT 0)
-    int verify = edsign_verify(signature, public_key, message, message_len);
-    if (verify == 0)
-        printf("SIGNATURE NOT VERIFIED\n");
-    else
-        printf("SIGNATURE VERIFIED\n");
+    didCryptoGenerate(&ctx, secret_key, public_key);
+    memset(long_message, 0xa5, sizeof(long_message));
+    didCryptoSign(signature, &ctx, long_message, sizeof(long_message));
+    didCryptoWipe(&ctx);
+    memset(secret_key, 0, sizeof(secret_key));
 
-    //Turn signature to base64 string
-    char* signature_base64 = calloc(EDSIGN_SIGNATURE_SIZE * 2, sizeof(char));
-    bytes_to_base64url(signature, EDSIGN_SIGNATURE_SIZE, signature_base64);
+    bool valid = signSelfCheck(signature, long_message, sizeof(long_message), public_key);
 
-    free(signature);
+    signature[0] ^= 0x01;
+    bool forged = didCryptoVerify(signature, public_key, long_message, sizeof(long_message));
+    if (forged) {
+        signStats.failed++;
+    }
 
-    return signature_base64;
+    return (known && valid && !forged) ? 0 : -1;
 }
 //----------------------------------------------------------------
 
-// STRUCTS TO STRING FOR JSON ------------------------------------
+// STREAMING WRITER -----------------------------------------------
+// The JSON serializers walk a structure once and push its text into a writer
+// instead of building nested heap strings. A writer appends to a bounded
+// buffer (or only counts without one), can feed a SHA-256 context with the
+// text and can base64url encode the text on its way into the buffer. Text that
+// does not fit marks the writer truncated instead of overflowing the buffer.
 
-char* jwkToString(jwk* jwk){
-    char* jwk_str = calloc(200, sizeof(char));
-    sprintf(jwk_str, "{\"kty\":\"%s\",\"crv\":\"%s\",\"x\":\"%s\"}", jwk->kty, jwk->crv, jwk->x);
-    return jwk_str;
+typedef struct {
+    char* buf;                  //OUTPUT BUFFER, NULL TO ONLY HASH AND COUNT
+    size_t size;                //SIZE OF buf INCLUDING THE NULL TERMINATOR
+    size_t len;                 //BYTES OF OUTPUT, ALSO COUNTED PAST size
+    sha256_context_t* sha;      //HASH OF THE TEXT BEFORE ENCODING, NULL FOR NONE
+    bool base64url;             //ENCODE THE TEXT AS BASE64URL (NO PADDING)
+    uint8_t group[3];           //BYTES WAITING FOR A FULL BASE64URL GROUP
+    uint8_t group_len;
+    bool truncated;             //OUTPUT DID NOT FIT INTO buf
+} did_writer;
+
+static const char base64url_alphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+/** @brief  Start a writer
+* @param[out] w writer
+* @param[in] buf output buffer, NULL to only hash and count
+* @param[in] size size of buf
+* @param[in] sha SHA-256 context to feed with the text, NULL for none
+*/
+static void writerInit(did_writer* w, char* buf, size_t size, sha256_context_t* sha){
+    memset(w, 0, sizeof(*w));
+    w->buf = buf;
+    w->size = size;
+    w->sha = sha;
 }
 
-char* jwkToStringLexicographically(jwk* jwk){ //LEXYCOGRAPHICALLY ORDERED FOR THUMPRINT OF JWK
-    char* jwk_str = calloc(200, sizeof(char));
-    sprintf(jwk_str, "{\"crv\":\"%s\",\"kty\":\"%s\",\"x\":\"%s\"}", jwk->crv, jwk->kty, jwk->x);
-    return jwk_str;
+static void writerOut(did_writer* w, const char* data, size_t len){
+    if (w->buf != NULL) {
+        if (w->truncated || w->len + len >= w->size) {
+            w->truncated = true;
+        }
+        else {
+            memcpy(w->buf + w->len, data, len);
+        }
+    }
+    w->len += len;
 }
 
-char* didProofHeaderToString(did_proof_header* header){
-    char* header_str = calloc(300, sizeof(char));
-    sprintf(header_str, "{\"alg\":\"%s\",\"jwk\":%s}", header->alg, jwkToString(header->jwk));
-    return header_str;
+static void writerEncodeGroup(did_writer* w){
+    const uint8_t* g = w->group;
+    char out[4] = {
+        base64url_alphabet[g[0] >> 2],
+        base64url_alphabet[((g[0] & 0x03) << 4) | (g[1] >> 4)],
+        base64url_alphabet[((g[1] & 0x0f) << 2) | (g[2] >> 6)],
+        base64url_alphabet[g[2] & 0x3f],
+    };
+
+    writerOut(w, out, w->group_len + 1);
+    w->group_len = 0;
 }
 
-char* didProofPayloadToString(did_proof_payload* payload){
-    char* payload_str = calloc(300, sizeof(char));
-    sprintf(payload_str, "{\"iat\":%s,\"exp\":%s,\"s256\":\"%s\"}", payload->iat, payload->exp, payload->s256);
-    return payload_str;
+/** @brief  Switch base64url encoding of the following text on or off
+* Switching it off encodes the bytes still waiting for a full group.
+*/
+static void writerBase64url(did_writer* w, bool on){
+    if (!on && w->group_len > 0) {
+        memset(w->group + w->group_len, 0, sizeof(w->group) - w->group_len);
+        writerEncodeGroup(w);
+    }
+    w->base64url = on;
 }
 
-char* didProofHeaderAndPayloadToString(did_proof* proof){
-    char* proof_str = calloc(600, sizeof(char));
-    sprintf(proof_str, "{\"header\":%s,\"payload\":%s", didProofHeaderToString(proof->header), didProofPayloadToString(proof->payload));
-    return proof_str;
+static void writerWrite(did_writer* w, const void* data, size_t len){
+    const uint8_t* bytes = data;
+
+    if (w->sha != NULL) {
+        sha256_update(w->sha, data, len);
+    }
+    if (!w->base64url) {
+        writerOut(w, data, len);
+        return;
+    }
+    for (size_t i = 0; i < len; i++) {
+        w->group[w->group_len++] = bytes[i];
+        if (w->group_len == sizeof(w->group)) {
+            writerEncodeGroup(w);
+        }
+    }
 }
 
-char* didProofHeaderAndPayloadToStringAsBase64url(did_proof* proof){
-    char* proof_str_base64 = calloc(600, sizeof(char));
+/** @brief  Write strings one after the other
+* @param[in] w writer
+* @param[in] ... strings, terminated by NULL
+*/
+static void writerCat(did_writer* w, ...){
+    va_list args;
 
-    char* header = calloc(300, sizeof(char));
-    bytes_to_base64url(didProofHeaderToString(proof->header), strlen(didProofHeaderToString(proof->header)), header);
+    va_start(args, w);
+    for (const char* str = va_arg(args, const char*); str != NULL; str = va_arg(args, const char*)) {
+        writerWrite(w, str, strlen(str));
+    }
+    va_end(args);
+}
 
-    char* payload = calloc(300, sizeof(char));
-    bytes_to_base64url(didProofPayloadToString(proof->payload), strlen(didProofPayloadToString(proof->payload)), payload);
+static void writerU32(did_writer* w, uint32_t val){
+    char str[10];
+    writerWrite(w, str, fmt_u32_dec(str, val));
+}
 
-    sprintf(proof_str_base64, "%s.%s", header, payload);
-    return proof_str_base64;
+static void writerS32(did_writer* w, int32_t val){
+    char str[11];
+    writerWrite(w, str, fmt_s32_dec(str, val));
 }
 
-char* didProofToString(did_proof* proof){
-    char* proof_str = calloc(600, sizeof(char));
-    sprintf(proof_str, "{\"header\":%s,\"payload\":%s,\"signature\":\"%s\"}", didProofHeaderToString(proof->header), didProofPayloadToString(proof->payload), proof->signature);
-    return proof_str;
+/** @brief  Finish the output, encode what is left and NULL terminate it
+* @param[in] w writer
+* @returns length of the output, 0 if it did not fit
+*/
+static size_t writerFinish(did_writer* w){
+    writerBase64url(w, false);
+
+    if (w->truncated) {
+        printf("Serialized %u bytes do not fit in %u bytes\n", (unsigned)w->len, (unsigned)w->size);
+        if (w->size > 0) {
+            w->buf[0] = '\0';
+        }
+        return 0;
+    }
+    if (w->buf != NULL) {
+        w->buf[w->len] = '\0';
+    }
+    return w->len;
 }
+//----------------------------------------------------------------
 
-char* didProofToStringAsBase64url(did_proof* proof){
-    char* proof_str_base64 = calloc(600, sizeof(char));
+// STRUCTS TO JSON ------------------------------------------------
+// Every serializer writes its structure, including the nested ones, in one
+// pass into the writer it is given. The constant fields come from the JSON
+// templates as literals, only the slots are taken from the structure.
 
-    char* header = calloc(300, sizeof(char));
-    bytes_to_base64url(didProofHeaderToString(proof->header), strlen(didProofHeaderToString(proof->header)), header);
+/* Write a string literal without measuring it at run time */
+#define WRITE_LITERAL(w, lit)   writerWrite((w), "" lit, LITERAL_LEN(lit))
 
-    char* payload = calloc(300, sizeof(char));
-    bytes_to_base64url(didProofPayloadToString(proof->payload), strlen(didProofPayloadToString(proof->payload)), payload);
+void jwkToJson(did_writer* w, jwk* jwk){
+    WRITE_LITERAL(w, JWK_JSON_HEAD);
+    writerWrite(w, jwk->x, DID_KEY_BASE64_LEN);
+    WRITE_LITERAL(w, JWK_JSON_TAIL);
+}
 
-    sprintf(proof_str_base64, "%s.%s.%s", header, payload, proof->signature);
-    return proof_str_base64;
+void jwkToJsonLexicographically(did_writer* w, jwk* jwk){ //LEXYCOGRAPHICALLY ORDERED FOR THUMPRINT OF JWK
+    WRITE_LITERAL(w, JWK_THUMBPRINT_HEAD);
+    writerWrite(w, jwk->x, DID_KEY_BASE64_LEN);
+    WRITE_LITERAL(w, JWK_JSON_TAIL);
 }
 
-char* attestationToString(attestation* attestation){
-    char* attestation_str = calloc(300, sizeof(char));
-    sprintf(attestation_str, "{\"id\":\"%s\",\"type\":\"%s\",\"publicKeyJwk\":%s}", attestation->id, attestation->type, jwkToString(attestation->publicKeyJwk));
-    return attestation_str;
+void didProofHeaderToJson(did_writer* w, did_proof_header* header){
+    WRITE_LITERAL(w, HEADER_JSON_HEAD);
+    jwkToJson(w, header->jwk);
+    WRITE_LITERAL(w, "}");
 }
 
-char* didDocumentToString(did_document* document){
-    char* document_str = calloc(300, sizeof(char));
-    sprintf(document_str, "{\"id\":\"%s\",\"attestation\":%s}", document->id, attestationToString(document->attestation));
-    return document_str;
+void didProofPayloadToJson(did_writer* w, did_proof_payload* payload){
+    WRITE_LITERAL(w, "{\"iat\":");
+    writerCat(w, payload->iat, NULL);
+    WRITE_LITERAL(w, ",\"exp\":");
+    writerCat(w, payload->exp, NULL);
+    WRITE_LITERAL(w, ",\"s256\":\"");
+    writerWrite(w, payload->s256, DID_HASH_BASE64_LEN);
+    WRITE_LITERAL(w, "\"}");
 }
 
-char* didDocumentToStringNoSignature(did_document* document){
-    char* document_str = calloc(300, sizeof(char));
-    sprintf(document_str, "{\"id\":\"%s\",\"attestation\":%s}", document->id, attestationToString(document->attestation));
-    return document_str;
+void didProofToJson(did_writer* w, did_proof* proof){
+    WRITE_LITERAL(w, "{\"header\":");
+    didProofHeaderToJson(w, proof->header);
+    WRITE_LITERAL(w, ",\"payload\":");
+    didProofPayloadToJson(w, proof->payload);
+    WRITE_LITERAL(w, ",\"signature\":\"");
+    writerWrite(w, proof->signature, DID_SIGNATURE_BASE64_LEN);
+    WRITE_LITERAL(w, "\"}");
 }
 
-char* didDocumentToStringAsBase64urlNoSignature(did_document* document){
-    char* document_str = calloc(300, sizeof(char));
-    sprintf(document_str, "{\"id\":\"%s\",\"attestation\":%s}", document->id, attestationToString(document->attestation));
-    char* document_str_base64 = calloc(300, sizeof(char));
-    bytes_to_base64url(document_str, strlen(document_str), document_str_base64);
-    
-    return document_str_base64;
+/** @brief  Signing input of the proof: header and payload, each as base64url, separated by a dot */
+void didProofSigningInput(did_writer* w, did_proof* proof){
+    writerBase64url(w, true);
+    didProofHeaderToJson(w, proof->header);
+    writerBase64url(w, false);
+
+    WRITE_LITERAL(w, ".");
+
+    writerBase64url(w, true);
+    didProofPayloadToJson(w, proof->payload);
+    writerBase64url(w, false);
 }
 
-char* didDocumentToStringAsBase64url(did_document* document){
-    char* document_base64 = calloc(500, sizeof(char));
+/** @brief  Proof as "header_base64url.payload_base64url.signature" */
+void didProofToBase64url(did_writer* w, did_proof* proof){
+    didProofSigningInput(w, proof);
+    WRITE_LITERAL(w, ".");
+    writerWrite(w, proof->signature, DID_SIGNATURE_BASE64_LEN);
+}
 
-    char* document_str = calloc(300, sizeof(char));
-    sprintf(document_str, "{\"id\":\"%s\",\"attestation\":%s}", document->id, attestationToString(document->attestation));
-    char* document_str_base64 = calloc(300, sizeof(char));
-    bytes_to_base64url(document_str, strlen(document_str), document_str_base64);
+void attestationToJson(did_writer* w, attestation* attestation){
+    WRITE_LITERAL(w, ATTESTATION_JSON_HEAD);
+    jwkToJson(w, attestation->publicKeyJwk);
+    WRITE_LITERAL(w, "}");
+}
 
-    sprintf(document_base64, "%s", document_str_base64);
-    
-    return document_base64;
+void didDocumentToJson(did_writer* w, did_document* document){
+    WRITE_LITERAL(w, "{\"id\":\"");
+    writerWrite(w, document->id, DID_ID_LEN);
+    WRITE_LITERAL(w, "\",\"attestation\":");
+    attestationToJson(w, document->attestation);
+    WRITE_LITERAL(w, "}");
 }
 
-char* didToString(did* deviceDID){
-    char* did_str = calloc(900, sizeof(char));
-    sprintf(did_str, "{\"document\":%s,\"proof\":%s}", didDocumentToString(deviceDID->document), didProofToString(deviceDID->proof));
-    return did_str;
+void didToJson(did_writer* w, did* deviceDID){
+    WRITE_LITERAL(w, "{\"document\":");
+    didDocumentToJson(w, deviceDID->document);
+    WRITE_LITERAL(w, ",\"proof\":");
+    didProofToJson(w, deviceDID->proof);
+    WRITE_LITERAL(w, "}");
 }
 
-char* didToStringAsBase64(did* deviceDID){
-    char* did_str_base64 = calloc(900, sizeof(char));
+/** @brief  DID as "document_base64url proof_base64url" */
+void didToBase64url(did_writer* w, did* deviceDID){
+    writerBase64url(w, true);
+    didDocumentToJson(w, deviceDID->document);
+    writerBase64url(w, false);
 
-    sprintf(did_str_base64, "%s %s", didDocumentToStringAsBase64url(deviceDID->document), didProofToStringAsBase64url(deviceDID->proof));
-    return did_str_base64;
+    WRITE_LITERAL(w, " ");
+    didProofToBase64url(w, deviceDID->proof);
+}
+
+// HASHES OF DID STRUCTURES --------------------------------------
+// The canonical JSON of a structure is fed straight into SHA-256, the digest
+// is written into caller storage.
+
+/* SHA-256 context after JWK_THUMBPRINT_HEAD, copied instead of hashing
+ * the prefix again. The prefix is shorter than a SHA-256 block, so this only
+ * saves buffering it, the compression still runs once x is added. */
+static sha256_context_t ed25519_thumbprint_midstate;
+static bool ed25519_thumbprint_midstate_ready = false;
+
+/** @brief  SHA-256 JWK thumbprint (RFC 7638)
+* @param[out] digest SHA256_DIGEST_LENGTH bytes
+* @param[in] jwk JWK
+*/
+void jwkThumbprint(uint8_t* digest, jwk* jwk){
+    sha256_context_t sha;
+    did_writer w;
+
+    if (!ed25519_thumbprint_midstate_ready) {
+        sha256_init(&ed25519_thumbprint_midstate);
+        sha256_update(&ed25519_thumbprint_midstate, JWK_THUMBPRINT_HEAD, LITERAL_LEN(JWK_THUMBPRINT_HEAD));
+        ed25519_thumbprint_midstate_ready = true;
+    }
+    sha = ed25519_thumbprint_midstate;
+    writerInit(&w, NULL, 0, &sha);
+    writerWrite(&w, jwk->x, DID_KEY_BASE64_LEN);
+    WRITE_LITERAL(&w, JWK_JSON_TAIL);
+    sha256_final(&sha, digest);
+}
+
+/** @brief  SHA-256 of the DID document JSON, the s256 of the proof payload
+* @param[out] digest SHA256_DIGEST_LENGTH bytes
+* @param[in] document DID document
+*/
+void didDocumentDigest(uint8_t* digest, did_document* document){
+    sha256_context_t sha;
+    did_writer w;
+
+    sha256_init(&sha);
+    writerInit(&w, NULL, 0, &sha);
+    didDocumentToJson(&w, document);
+    sha256_final(&sha, digest);
+}
+
+// STRUCTS TO CBOR (CONTENT-FORMAT 60) ---------------------------
+// Same maps and keys as the JSON text. Base64url values are sent as byte
+// strings and timestamps as integers, so the gateway can rebuild the exact
+// JSON that was hashed and signed.
+
+/** @brief   Convert base64url to bytes
+* @param[in]   str     base64url string
+* @param[out]  out_bytes  bytes
+* @param[in]  out_bytes_size  size of bytes array (3 bytes more than the data for the decoder)
+* @returns      number of bytes, 0 on error
+*/
+static size_t base64urlToBytes(const char* str, uint8_t* out_bytes, size_t out_bytes_size){
+    size_t size = out_bytes_size;
+
+    if (base64url_decode(str, strlen(str), out_bytes, &size) != BASE64_SUCCESS) {
+        return 0;
+    }
+    return size;
+}
+
+/** @brief  Put a base64url value as a CBOR byte string
+* @param[in] enc encoder
+* @param[in] str base64url value
+* @returns 0 on success, -1 if str is not valid base64url (nothing is put)
+*/
+static int putBase64urlAsBstr(nanocbor_encoder_t* enc, const char* str){
+    uint8_t bytes[DID_CRYPTO_SIGNATURE_SIZE + 3]; //LARGEST VALUE IS A SIGNATURE
+    size_t size = base64urlToBytes(str, bytes, sizeof(bytes));
+
+    if (size == 0) {
+        printf("Could not decode base64url value %s\n", str);
+        return -1;
+    }
+    nanocbor_put_bstr(enc, bytes, size);
+    return 0;
+}
+
+/* The CBOR serializers return 0 on success and -1 if a base64url value of the
+ * structure could not be decoded, the representation is then not served. */
+
+int jwkToCbor(nanocbor_encoder_t* enc, jwk* jwk){
+    nanocbor_fmt_map(enc, 3);
+    nanocbor_put_tstr(enc, "kty");
+    nanocbor_put_tstr(enc, jwk->kty);
+    nanocbor_put_tstr(enc, "crv");
+    nanocbor_put_tstr(enc, jwk->crv);
+    nanocbor_put_tstr(enc, "x");
+    return putBase64urlAsBstr(enc, jwk->x);
+}
+
+int didProofHeaderToCbor(nanocbor_encoder_t* enc, did_proof_header* header){
+    nanocbor_fmt_map(enc, 2);
+    nanocbor_put_tstr(enc, "alg");
+    nanocbor_put_tstr(enc, header->alg);
+    nanocbor_put_tstr(enc, "jwk");
+    return jwkToCbor(enc, header->jwk);
+}
+
+int didProofPayloadToCbor(nanocbor_encoder_t* enc, did_proof_payload* payload){
+    nanocbor_fmt_map(enc, 3);
+    nanocbor_put_tstr(enc, "iat");
+    nanocbor_fmt_uint(enc, strtoul(payload->iat, NULL, 10));
+    nanocbor_put_tstr(enc, "exp");
+    nanocbor_fmt_uint(enc, strtoul(payload->exp, NULL, 10));
+    nanocbor_put_tstr(enc, "s256");
+    return putBase64urlAsBstr(enc, payload->s256);
+}
+
+int didProofToCbor(nanocbor_encoder_t* enc, did_proof* proof){
+    nanocbor_fmt_map(enc, 3);
+    nanocbor_put_tstr(enc, "header");
+    if (didProofHeaderToCbor(enc, proof->header) != 0) {
+        return -1;
+    }
+    nanocbor_put_tstr(enc, "payload");
+    if (didProofPayloadToCbor(enc, proof->payload) != 0) {
+        return -1;
+    }
+    nanocbor_put_tstr(enc, "signature");
+    return putBase64urlAsBstr(enc, proof->signature);
+}
+
+int attestationToCbor(nanocbor_encoder_t* enc, attestation* attestation){
+    nanocbor_fmt_map(enc, 3);
+    nanocbor_put_tstr(enc, "id");
+    nanocbor_put_tstr(enc, attestation->id);
+    nanocbor_put_tstr(enc, "type");
+    nanocbor_put_tstr(enc, attestation->type);
+    nanocbor_put_tstr(enc, "publicKeyJwk");
+    return jwkToCbor(enc, attestation->publicKeyJwk);
+}
+
+int didDocumentToCbor(nanocbor_encoder_t* enc, did_document* document){
+    nanocbor_fmt_map(enc, 2);
+    nanocbor_put_tstr(enc, "id");
+    nanocbor_put_tstr(enc, document->id);
+    nanocbor_put_tstr(enc, "attestation");
+    return attestationToCbor(enc, document->attestation);
+}
+
+int didToCbor(nanocbor_encoder_t* enc, did* deviceDID){
+    if (didDocumentToCbor(enc, deviceDID->document) != 0) {
+        return -1;
+    }
+    return didProofToCbor(enc, deviceDID->proof);
+}
+
+/** @brief  Length of a finished CBOR representation
+* @param[in] enc encoder that wrote the representation
+* @param[in] size size of the buffer of the encoder
+* @returns length of the representation, 0 if it did not fit
+*/
+static size_t finishCbor(nanocbor_encoder_t* enc, size_t size){
+    size_t len = nanocbor_encoded_len(enc);
+
+    if (len > size) {
+        printf("DID CBOR response of %u bytes does not fit in %u bytes\n", (unsigned)len, (unsigned)size);
+        return 0;
+    }
+    return len;
 }
 //----------------------------------------------------------------
 
-// CREATE DID INFO
-jwk* createJwk(char* kty, char* crv, char* x){
-    jwk* jwk = calloc(1, sizeof(jwk));
+// COSE_SIGN1 (RFC 9052, CONTENT-FORMAT 18) ----------------------
+// Compact alternative to the JWS-style proof: binary keys and a kid in the
+// protected header instead of the base64url JSON header with inline JWK.
+// /riot/did signs the CBOR document directly with the proof key, kid is the
+// DID thumbprint. /riot/data signs the CBOR reading with the document key,
+// kid is the first COSE_DATA_KID_SIZE bytes of the same thumbprint.
+#ifndef COAP_FORMAT_COSE_SIGN1
+#define COAP_FORMAT_COSE_SIGN1      (18)
+#endif
+
+#define COSE_HEADER_ALG             (1)
+#define COSE_HEADER_KID             (4)
+#define COSE_ALG_EDDSA              (-8)
+
+#ifndef COSE_DATA_KID_SIZE
+#define COSE_DATA_KID_SIZE          (8U)
+#endif
+
+#ifndef DID_COSE_RESPONSE_BUF_SIZE
+#define DID_COSE_RESPONSE_BUF_SIZE  (400U)
+#endif
+
+/* {alg, kid} with a kid of up to SHA256_DIGEST_LENGTH bytes */
+#define COSE_PROTECTED_MAX          (SHA256_DIGEST_LENGTH + 8)
+
+static uint8_t did_cose_response[DID_COSE_RESPONSE_BUF_SIZE]; //COSE_Sign1 of DID
+static size_t did_cose_response_len = 0;
+
+static uint8_t data_cose_response[128]; //COSE_Sign1 of reading
+static size_t data_cose_response_len = 0;
+
+static uint8_t did_kid[COSE_DATA_KID_SIZE]; //KID OF DATA SIGNATURES
+
+static uint8_t cose_payload[DID_COSE_RESPONSE_BUF_SIZE];
+static uint8_t cose_tbs[DID_COSE_RESPONSE_BUF_SIZE + 32]; //SIG_STRUCTURE
+
+/** @brief  Sign a CBOR payload as an untagged COSE_Sign1 with EdDSA
+* @param[out] out buffer for the COSE_Sign1
+* @param[in] out_size size of out
+* @param[in] kid key identifier for the protected header
+* @param[in] kid_len length of kid
+* @param[in] payload CBOR payload
+* @param[in] payload_len length of payload
+* @param[in] signer key pair to sign with
+* @returns length of the COSE_Sign1, 0 if it did not fit
+*/
+static size_t coseSign1(uint8_t* out, size_t out_size, const uint8_t* kid, size_t kid_len,
+                        const uint8_t* payload, size_t payload_len, key_pair* signer){
+    nanocbor_encoder_t enc;
+
+    //PROTECTED HEADER {alg: EdDSA, kid: kid}
+    uint8_t protected[COSE_PROTECTED_MAX];
+    nanocbor_encoder_init(&enc, protected, sizeof(protected));
+    nanocbor_fmt_map(&enc, 2);
+    nanocbor_fmt_uint(&enc, COSE_HEADER_ALG);
+    nanocbor_fmt_int(&enc, COSE_ALG_EDDSA);
+    nanocbor_fmt_uint(&enc, COSE_HEADER_KID);
+    nanocbor_put_bstr(&enc, kid, kid_len);
+    size_t protected_len = finishCbor(&enc, sizeof(protected));
+
+    //SIG_STRUCTURE ["Signature1", protected, external_aad, payload]
+    nanocbor_encoder_init(&enc, cose_tbs, sizeof(cose_tbs));
+    nanocbor_fmt_array(&enc, 4);
+    nanocbor_put_tstr(&enc, "Signature1");
+    nanocbor_put_bstr(&enc, protected, protected_len);
+    nanocbor_fmt_bstr(&enc, 0);
+    nanocbor_put_bstr(&enc, payload, payload_len);
+    size_t tbs_len = finishCbor(&enc, sizeof(cose_tbs));
+
+    if (protected_len == 0 || tbs_len == 0) {
+        return 0;
+    }
+
+    uint8_t signature[DID_CRYPTO_SIGNATURE_SIZE];
+    sign_message_bytes(signature, cose_tbs, tbs_len, signer->signer);
+
+    //COSE_SIGN1 [protected, unprotected, payload, signature]
+    nanocbor_encoder_init(&enc, out, out_size);
+    nanocbor_fmt_array(&enc, 4);
+    nanocbor_put_bstr(&enc, protected, protected_len);
+    nanocbor_fmt_map(&enc, 0);
+    nanocbor_put_bstr(&enc, payload, payload_len);
+    nanocbor_put_bstr(&enc, signature, sizeof(signature));
+    return finishCbor(&enc, out_size);
+}
+
+/** @brief  Sign the DID as COSE_Sign1 into did_cose_response
+* Payload is {"document": document, "iat": iat, "exp": exp, "x": proof key}.
+* @param[in] deviceDID DID to sign
+* @param[in] signer proof key pair
+*/
+static void didToCose(did* deviceDID, key_pair* signer){
+    nanocbor_encoder_t enc;
+
+    nanocbor_encoder_init(&enc, cose_payload, sizeof(cose_payload));
+    nanocbor_fmt_map(&enc, 4);
+    nanocbor_put_tstr(&enc, "document");
+    int res = didDocumentToCbor(&enc, deviceDID->document);
+    nanocbor_put_tstr(&enc, "iat");
+    nanocbor_fmt_uint(&enc, strtoul(deviceDID->proof->payload->iat, NULL, 10));
+    nanocbor_put_tstr(&enc, "exp");
+    nanocbor_fmt_uint(&enc, strtoul(deviceDID->proof->payload->exp, NULL, 10));
+    nanocbor_put_tstr(&enc, "x");
+    res |= putBase64urlAsBstr(&enc, deviceDID->proof->header->jwk->x);
+    size_t payload_len = (res == 0) ? finishCbor(&enc, sizeof(cose_payload)) : 0;
+
+    //THE DID ID IS DID_ID_PREFIX + BASE64URL OF THE THUMBPRINT
+    uint8_t thumbprint[SHA256_DIGEST_LENGTH + 3];
+    size_t thumbprint_len = base64urlToBytes(deviceDID->document->id + LITERAL_LEN(DID_ID_PREFIX), thumbprint, sizeof(thumbprint));
+    memcpy(did_kid, thumbprint, sizeof(did_kid));
+
+    did_cose_response_len = 0;
+    if (payload_len > 0 && thumbprint_len == SHA256_DIGEST_LENGTH) {
+        did_cose_response_len = coseSign1(did_cose_response, sizeof(did_cose_response), thumbprint, thumbprint_len,
+                                          cose_payload, payload_len, signer);
+    }
+}
+//----------------------------------------------------------------
+
+/** @brief  Serialize all DID representations once into the response buffers
+* @param[in] deviceDID DID to serialize
+*/
+void cacheDidResponses(did* deviceDID){
+    did_writer w;
+
+    writerInit(&w, did_response, sizeof(did_response), NULL);
+    didToBase64url(&w, deviceDID);
+    did_response_len = writerFinish(&w);
+
+    writerInit(&w, did_document_response, sizeof(did_document_response), NULL);
+    didDocumentToJson(&w, deviceDID->document);
+    did_document_response_len = writerFinish(&w);
+
+    writerInit(&w, did_proof_response, sizeof(did_proof_response), NULL);
+    didProofToJson(&w, deviceDID->proof);
+    did_proof_response_len = writerFinish(&w);
+
+    nanocbor_encoder_t enc;
+
+    nanocbor_encoder_init(&enc, did_cbor_response, sizeof(did_cbor_response));
+    nanocbor_fmt_array(&enc, 2);
+    did_cbor_response_len = (didToCbor(&enc, deviceDID) == 0) ? finishCbor(&enc, sizeof(did_cbor_response)) : 0;
+
+    nanocbor_encoder_init(&enc, did_document_cbor_response, sizeof(did_document_cbor_response));
+    did_document_cbor_response_len = (didDocumentToCbor(&enc, deviceDID->document) == 0) ?
+                                     finishCbor(&enc, sizeof(did_document_cbor_response)) : 0;
+
+    nanocbor_encoder_init(&enc, did_proof_cbor_response, sizeof(did_proof_cbor_response));
+    did_proof_cbor_response_len = (didProofToCbor(&enc, deviceDID->proof) == 0) ?
+                                  finishCbor(&enc, sizeof(did_proof_cbor_response)) : 0;
+
+    didToCose(deviceDID, proof_key_pair);
+
+    uint8_t s256[SHA256_DIGEST_LENGTH + 3];
+    base64urlToBytes(deviceDID->proof->payload->s256, s256, sizeof(s256));
+    memcpy(did_etag_hash, s256, sizeof(did_etag_hash));
+}
+//----------------------------------------------------------------
+
+// CREATE DID INFO (ALLOCATED IN THE ARENA OF THE GENERATION BEING BUILT)
+/* "header_base64url.payload_base64url" the proof signature is made over */
+static char did_signing_input[SIGNING_INPUT_MAX_LEN + 1];
+
+jwk* createJwk(did_arena* arena, char* kty, char* crv, char* x){
+    jwk* jwk = arenaAlloc(arena, sizeof(*jwk));
     jwk->kty = kty;
     jwk->crv = crv;
     jwk->x = x;
     return jwk;
 }
 
-did_proof_header* createDidProofHeader(char* alg, jwk* jwk){
-    did_proof_header* header = calloc(1, sizeof(did_proof_header));
+did_proof_header* createDidProofHeader(did_arena* arena, char* alg, jwk* jwk){
+    did_proof_header* header = arenaAlloc(arena, sizeof(*header));
     header->alg = alg;
     header->jwk = jwk;
     return header;
 }
 
-did_proof_payload* createDidProofPayload(char* iat, char* exp, char* s256){
-    did_proof_payload* payload = calloc(1, sizeof(did_proof_payload));
+did_proof_payload* createDidProofPayload(did_arena* arena, char* iat, char* exp, char* s256){
+    did_proof_payload* payload = arenaAlloc(arena, sizeof(*payload));
     payload->iat = iat;
     payload->exp = exp;
     payload->s256 = s256;
     return payload;
 }
 
-did_proof* createDidProof(did_proof_header* header, did_proof_payload* payload){
-    did_proof* proof = calloc(1, sizeof(did_proof));
+did_proof* createDidProof(did_arena* arena, did_proof_header* header, did_proof_payload* payload, key_pair* signer){
+    did_proof* proof = arenaAlloc(arena, sizeof(*proof));
     proof->header = header;
     proof->payload = payload;
 
-    char* msg = didProofHeaderAndPayloadToStringAsBase64url(proof);
-    printf("\n\naaa\n%s\n\n", msg);
-    char *signature_base64 = sign_message((uint8_t*) msg, strlen(msg), proof_key_pair->secret_key_bytes, proof_key_pair->public_key_bytes);
-    proof->signature = signature_base64;
-    
+    did_writer w;
+    writerInit(&w, did_signing_input, sizeof(did_signing_input), NULL);
+    didProofSigningInput(&w, proof);
+    size_t msg_len = writerFinish(&w);
+
+    proof->signature = arenaAlloc(arena, SIGNATURE_BASE64_SIZE);
+    sign_message(proof->signature, (uint8_t*) did_signing_input, msg_len, signer->signer);
+
     return proof;
 }
 
-attestation* createAttestation(char* id, char* type, jwk* publicKeyJwk){
-    attestation* attestation = calloc(1, sizeof(attestation));
+attestation* createAttestation(did_arena* arena, char* id, char* type, jwk* publicKeyJwk){
+    attestation* attestation = arenaAlloc(arena, sizeof(*attestation));
     attestation->id = id;
     attestation->type = type;
     attestation->publicKeyJwk = publicKeyJwk;
     return attestation;
 }
 
-did_document* createDidDocument(char* id, attestation* attestation){
-    did_document* document = calloc(1, sizeof(did_document));
+did_document* createDidDocument(did_arena* arena, char* id, attestation* attestation){
+    did_document* document = arenaAlloc(arena, sizeof(*document));
     document->id = id;
     document->attestation = attestation;
-
-    char* msg = didDocumentToStringAsBase64urlNoSignature(document);
-    printf("\n\nbbb\n%s\n\n", msg);
-    
-    
     return document;
 }
 
-did* createDid(did_document* document, did_proof* proof){
-    did* deviceDID = calloc(1, sizeof(did));
+did* createDid(did_arena* arena, did_document* document, did_proof* proof){
+    did* deviceDID = arenaAlloc(arena, sizeof(*deviceDID));
     deviceDID->document = document;
     deviceDID->proof = proof;
     return deviceDID;
@@ -326,89 +1029,646 @@ did* createDid(did_document* document, did_proof* proof){
 //----------------------------------------------------------------
 
 //DELETE & FREE MEMORY
+/** @brief  Tear down a whole DID generation (DID graph and its key pairs)
+* @param[in] deviceDID DID to delete, must not be the DID still served
+*/
 void deleteDid(did* deviceDID){
     if (deviceDID != NULL) {
-        // free(deviceDID->proof->header->alg);
-        // free(deviceDID->proof->header->jwk->kty);
-        // free(deviceDID->proof->header->jwk->crv);
-        // free(deviceDID->proof->header->jwk);
-        // free(deviceDID->proof->header);
-        // free(deviceDID->proof->payload->iat);
-        // free(deviceDID->proof->payload->exp);
-        // free(deviceDID->proof->payload->s256);
-        // free(deviceDID->proof->payload);
-        // free(deviceDID->proof->signature);
-        // free(deviceDID->proof);
-        // free(deviceDID->document->id);
-        // free(deviceDID->document->attestation->id);
-        // free(deviceDID->document->attestation->type);
-        // free(deviceDID->document->attestation->publicKeyJwk->kty);
-        // free(deviceDID->document->attestation->publicKeyJwk->crv);
-        // free(deviceDID->document->attestation->publicKeyJwk);
-        // free(deviceDID->document->attestation);
-        // free(deviceDID->document->signature);
-        // free(deviceDID->document);
-        // free(deviceDID);
-        deviceDID = NULL;
-    }
-}
-
-void deleteKeyPair(key_pair* keyPair) {
-    if (keyPair != NULL) {
-        free(keyPair->secret_key_bytes);
-        free(keyPair->public_key_bytes);
-        free(keyPair->secret_key_base64);
-        free(keyPair->public_key_base64);
-        free(keyPair);
-        keyPair = NULL;
+        arenaReset(arenaOf(deviceDID));
+    }
+}
+
+//----------------------------------------------------------------
+
+//BLOCKWISE REPLIES (RFC 7959 BLOCK2) -----------------------------
+/* Block size of replies as SZX, the block size is 2^(SZX+4) bytes. The
+ * default of 64 bytes keeps a block and its headers in one 802.15.4 frame. */
+#ifndef CONFIG_DID_BLOCK_SZX
+#define CONFIG_DID_BLOCK_SZX        COAP_BLOCKSIZE_64
+#endif
+
+/* Room kept in the reply buffer for the options of a blockwise reply */
+#define DID_REPLY_OPTIONS_MAX       (32U)
+
+/* Max-Age of replies in seconds. The board and the DID rarely change (the DID
+ * is revalidated with its ETag), a reading is fresh for one sampling period. */
+#ifndef CONFIG_DID_BOARD_MAX_AGE
+#define CONFIG_DID_BOARD_MAX_AGE    (86400U)
+#endif
+#ifndef CONFIG_DID_MAX_AGE
+#define CONFIG_DID_MAX_AGE          (3600U)
+#endif
+#define DID_DATA_MAX_AGE            ((CONFIG_DID_OBSERVE_SAMPLE_MS + 999U) / 1000U)
+
+/* Options of a reply besides Content-Format and Block2 */
+typedef struct {
+    const uint8_t *etag;    //ETAG, NULL FOR NONE
+    size_t etag_len;
+    int32_t observe;        //OBSERVE, -1 FOR NONE
+    int32_t max_age;        //MAX-AGE, -1 FOR THE DEFAULT OF 60 S
+} reply_options;
+
+/** @brief  Initialize a Block2 slicer for the block asked by the client
+* The block size is the smallest of the configured one, the one asked by the
+* client and the largest one that still fits in the reply buffer.
+* @param[in] pkt request
+* @param[out] slicer slicer to initialize
+* @param[in] len size of the reply buffer
+*/
+static void _block2_init(coap_pkt_t *pkt, coap_block_slicer_t *slicer, size_t len)
+{
+    coap_block1_t block2;
+    unsigned szx = CONFIG_DID_BLOCK_SZX;
+    size_t offset = 0;
+
+    if (coap_get_block2(pkt, &block2)) {
+        szx = MIN(szx, block2.szx);
+        offset = block2.offset;
+    }
+
+    size_t avail = len - coap_get_total_hdr_len(pkt) - DID_REPLY_OPTIONS_MAX;
+    while (szx > 0 && coap_szx2size(szx) > avail) {
+        szx--;
+    }
+
+    coap_block_slicer_init(slicer, offset / coap_szx2size(szx), coap_szx2size(szx));
+}
+
+/** @brief  Reply with the block of payload asked by the client
+* @param COAP-PARAMETERS
+* @param[in] ct content format of payload
+* @param[in] payload complete representation
+* @param[in] payload_len length of complete representation
+* @param[in] opts ETag, Observe and Max-Age options of every block, NULL for none
+* @returns length of reply
+*/
+static ssize_t replyBlockwiseOpts(coap_pkt_t *pkt, uint8_t *buf, size_t len,
+                                  unsigned ct, const void *payload, size_t payload_len,
+                                  const reply_options *opts)
+{
+    coap_block_slicer_t slicer;
+    _block2_init(pkt, &slicer, len);
+
+    uint8_t *payload_start = buf + coap_get_total_hdr_len(pkt);
+    uint8_t *bufpos = payload_start;
+    uint16_t lastonum = 0;
+
+    if (opts && opts->etag) {
+        bufpos += coap_put_option(bufpos, lastonum, COAP_OPT_ETAG, opts->etag, opts->etag_len);
+        lastonum = COAP_OPT_ETAG;
+    }
+    if (opts && opts->observe >= 0) {
+        bufpos += coap_opt_put_uint(bufpos, lastonum, COAP_OPT_OBSERVE, opts->observe);
+        lastonum = COAP_OPT_OBSERVE;
+    }
+    bufpos += coap_put_option_ct(bufpos, lastonum, ct);
+    lastonum = COAP_OPT_CONTENT_FORMAT;
+    if (opts && opts->max_age >= 0) {
+        bufpos += coap_opt_put_uint(bufpos, lastonum, COAP_OPT_MAX_AGE, opts->max_age);
+        lastonum = COAP_OPT_MAX_AGE;
+    }
+    bufpos += coap_opt_put_block2(bufpos, lastonum, &slicer, 1);
+    *bufpos++ = 0xff;
+
+    bufpos += coap_blockwise_put_bytes(&slicer, bufpos, payload, payload_len);
+
+    return coap_block2_build_reply(pkt, COAP_CODE_205, buf, len,
+                                   bufpos - payload_start, &slicer);
+}
+
+/** @brief  Reply with the block of payload asked by the client
+* @param COAP-PARAMETERS
+* @param[in] ct content format of payload
+* @param[in] payload complete representation
+* @param[in] payload_len length of complete representation
+* @returns length of reply
+*/
+static ssize_t replyBlockwise(coap_pkt_t *pkt, uint8_t *buf, size_t len,
+                              unsigned ct, const void *payload, size_t payload_len)
+{
+    return replyBlockwiseOpts(pkt, buf, len, ct, payload, payload_len, NULL);
+}
+
+/** @brief  Check the ETag options of a request (RFC 7252 5.10.6.2)
+* @param[in] pkt request
+* @param[in] etag current ETag of the representation
+* @param[in] etag_len length of etag
+* @returns true if the client already has the current representation
+*/
+static bool _etag_matches(coap_pkt_t *pkt, const uint8_t *etag, size_t etag_len)
+{
+    coap_optpos_t opt = { 0, 0 };
+    uint8_t *value;
+    ssize_t value_len;
+    bool init = true;
+
+    while ((value_len = coap_opt_get_next(pkt, &opt, &value, init)) >= 0) {
+        init = false;
+        if (opt.opt_num == COAP_OPT_ETAG && (size_t)value_len == etag_len && memcmp(value, etag, etag_len) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/** @brief  Content format asked for with the Accept option
+* @param[in] pkt request
+* @returns COAP_FORMAT_TEXT if there is no Accept option, -1 if not supported
+*/
+static int _accepted_format(coap_pkt_t *pkt)
+{
+    uint32_t accept;
+
+    if (coap_opt_get_uint(pkt, COAP_OPT_ACCEPT, &accept) != 0) {
+        return COAP_FORMAT_TEXT;
+    }
+    if (accept == COAP_FORMAT_TEXT || accept == COAP_FORMAT_CBOR || accept == COAP_FORMAT_COSE_SIGN1) {
+        return accept;
+    }
+    return -1;
+}
+
+/** @brief  Reply with the text, CBOR or COSE representation of a DID resource asked for by the client
+* Every block carries the ETag of the representation and CONFIG_DID_MAX_AGE.
+* A request with that ETag is answered with 2.03 Valid and no payload, one for
+* a representation that could not be serialized with 5.00.
+* @param COAP-PARAMETERS
+* @param[in] resource tag of the resource in the ETag
+* @param[in] text text representation
+* @param[in] text_len length of text representation
+* @param[in] cbor CBOR representation
+* @param[in] cbor_len length of CBOR representation
+* @param[in] cose COSE_Sign1 representation, NULL if the resource has none
+* @param[in] cose_len length of COSE_Sign1 representation
+* @returns length of reply
+*/
+static ssize_t replyNegotiated(coap_pkt_t *pkt, uint8_t *buf, size_t len, uint8_t resource,
+                               const char *text, size_t text_len,
+                               const uint8_t *cbor, size_t cbor_len,
+                               const uint8_t *cose, size_t cose_len)
+{
+    int format = _accepted_format(pkt);
+    const void *payload = text;
+    size_t payload_len = text_len;
+
+    if (format == COAP_FORMAT_CBOR) {
+        payload = cbor;
+        payload_len = cbor_len;
+    }
+    else if (format == COAP_FORMAT_COSE_SIGN1 && cose != NULL) {
+        payload = cose;
+        payload_len = cose_len;
+    }
+    else if (format != COAP_FORMAT_TEXT) {
+        return coap_build_reply(pkt, COAP_CODE_NOT_ACCEPTABLE, buf, len, 0);
+    }
+    if (payload_len == 0) {
+        //THE REPRESENTATION COULD NOT BE SERIALIZED
+        return coap_build_reply(pkt, COAP_CODE_INTERNAL_SERVER_ERROR, buf, len, 0);
+    }
+
+    uint8_t etag[DID_ETAG_SIZE];
+    memcpy(etag, did_etag_hash, DID_ETAG_HASH_SIZE);
+    etag[DID_ETAG_HASH_SIZE] = resource;
+    etag[DID_ETAG_HASH_SIZE + 1] = format;
+
+    if (_etag_matches(pkt, etag, sizeof(etag))) {
+        uint8_t *bufpos = buf + coap_get_total_hdr_len(pkt);
+        size_t opts_len = coap_put_option(bufpos, 0, COAP_OPT_ETAG, etag, sizeof(etag));
+        opts_len += coap_opt_put_uint(bufpos + opts_len, COAP_OPT_ETAG, COAP_OPT_MAX_AGE, CONFIG_DID_MAX_AGE);
+        return coap_build_reply(pkt, COAP_CODE_VALID, buf, len, opts_len);
+    }
+
+    reply_options opts = { .etag = etag, .etag_len = sizeof(etag), .observe = -1, .max_age = CONFIG_DID_MAX_AGE };
+    return replyBlockwiseOpts(pkt, buf, len, format, payload, payload_len, &opts);
+}
+//----------------------------------------------------------------
+
+//CRYPTO WORKER (SEPARATE RESPONSES, RFC 7252 5.2.2) --------------
+// Key generation and signing run in a worker thread with a lower priority
+// than the server loop. A request that needs them is copied into a job and
+// answered with an empty ACK, the worker then runs the same handler and sends
+// its reply as a separate response, confirmable if the request was. The DID,
+// its keys and the response buffers are guarded by did_lock, which the server
+// loop only tries to take so it never waits for the worker.
+// Confirmable separate responses and notifications are kept in a pending table
+// and retransmitted when the worker wakes up for them, so it is not blocked
+// until they are acknowledged. The reply of the last finished job of every
+// client is kept too, and a retransmission of its request is answered from it
+// instead of running the job again (RFC 7252 4.5).
+#ifndef CONFIG_DID_CRYPTO_JOBS
+#define CONFIG_DID_CRYPTO_JOBS          (4U)
+#endif
+#ifndef CONFIG_DID_CRYPTO_REQUEST_SIZE
+#define CONFIG_DID_CRYPTO_REQUEST_SIZE  (128U)
+#endif
+#ifndef CONFIG_DID_SEPARATE_PENDING
+#define CONFIG_DID_SEPARATE_PENDING     (4U)
+#endif
+#ifndef CONFIG_DID_CRYPTO_STACKSIZE
+#define CONFIG_DID_CRYPTO_STACKSIZE     (THREAD_STACKSIZE_LARGE * 2)
+#endif
+
+#define CRYPTO_MSG_JOB              (0x4430)
+#define CRYPTO_MSG_ACK              (0x4431)
+#define CRYPTO_MSG_SAMPLE           (0x4432)
+#define CRYPTO_MSG_QUEUE_SIZE       (8)
+
+/* One block of a reply and its headers */
+#define CRYPTO_RESPONSE_BUF_SIZE    ((16U << CONFIG_DID_BLOCK_SZX) + 64)
+
+typedef struct {
+    const coap_resource_t* resource;
+    sock_udp_ep_t remote;
+    uint8_t request[CONFIG_DID_CRYPTO_REQUEST_SIZE];
+    size_t request_len;
+} crypto_job;
+
+/* Reply of the last finished job of a client */
+typedef struct {
+    sock_udp_ep_t remote;
+    uint16_t id;                            //MESSAGE ID OF THE REQUEST
+    uint8_t token[COAP_TOKEN_LENGTH_MAX];
+    uint8_t token_len;
+    uint8_t response[CRYPTO_RESPONSE_BUF_SIZE]; //REPLY AS THE HANDLER BUILT IT, A PIGGYBACKED ACK
+    size_t response_len;
+} crypto_done;
+
+/* Confirmable message of the worker waiting for its ACK */
+typedef struct {
+    bool active;
+    sock_udp_ep_t remote;
+    uint16_t id;
+    uint8_t message[CRYPTO_RESPONSE_BUF_SIZE];
+    size_t message_len;
+    uint32_t due;                   //xtimer_now_usec() OF THE NEXT RETRANSMISSION
+    uint32_t timeout;               //DOUBLED AFTER EVERY RETRANSMISSION
+    unsigned retransmissions;
+} separate_pending;
+
+/* Jobs stay queued until their response is sent, so a retransmitted request is not run twice */
+static crypto_job crypto_jobs[CONFIG_DID_CRYPTO_JOBS];
+static unsigned crypto_jobs_first = 0;
+static unsigned crypto_jobs_count = 0;
+static crypto_done crypto_done_jobs[CONFIG_DID_CRYPTO_JOBS];
+static unsigned crypto_done_next = 0;
+static mutex_t crypto_jobs_lock = MUTEX_INIT; //JOBS AND FINISHED JOBS
+
+static separate_pending separate_pendings[CONFIG_DID_SEPARATE_PENDING]; //ONLY USED BY THE WORKER
+
+static mutex_t did_lock = MUTEX_INIT; //DID, KEYS AND RESPONSE BUFFERS
+
+static char crypto_stack[CONFIG_DID_CRYPTO_STACKSIZE];
+static msg_t crypto_msg_queue[CRYPTO_MSG_QUEUE_SIZE];
+static kernel_pid_t crypto_pid = KERNEL_PID_UNDEF;
+static uint8_t crypto_response[CRYPTO_RESPONSE_BUF_SIZE];
+static uint16_t separate_id;
+static bool sample_pending = false;
+
+static void notifyDataObservers(void);
+static void removeDataObserver(uint16_t id);
+static void armDataSampling(void);
+
+/* Send on the socket of the server loop, in main.c */
+extern ssize_t coapServerSend(const void* data, size_t len, const sock_udp_ep_t* remote);
+/* Multicast state of the server loop, in main.c */
+extern bool coapServerRequestIsMulticast(void);
+extern uint32_t coapServerDroppedReplies(void);
+
+/** @brief  Check if the running thread may create keys or sign
+* @returns true in the worker, or in the server loop while there is no worker
+*/
+static bool didMaySign(void){
+    return crypto_pid == KERNEL_PID_UNDEF || thread_getpid() == crypto_pid;
+}
+
+/** @brief  Take did_lock for a handler
+* The worker (or the server loop while there is no worker) always takes it.
+* The server loop only takes it if the handler needs no crypto and the worker
+* does not hold it, otherwise the request has to be deferred to the worker.
+* @param[in] needs_crypto handler has to create keys or sign
+* @returns true if the handler runs now and unlocks did_lock when done
+*/
+static bool didLock(bool needs_crypto){
+    if (didMaySign()) {
+        mutex_lock(&did_lock);
+        return true;
+    }
+    if (needs_crypto) {
+        return false;
+    }
+    return mutex_trylock(&did_lock);
+}
+
+/** @brief  Queue a request for the crypto worker and acknowledge it
+* Multicast requests are not queued: the worker would answer them without the
+* leisure, the client asks a device that stays silent by unicast.
+* @param COAP-PARAMETERS
+* @returns empty ACK for a confirmable request, nothing for a non-confirmable
+*          or multicast one, 5.03 if the queue is full
+*/
+static ssize_t deferToWorker(coap_pkt_t *pkt, uint8_t *buf, size_t len, coap_request_ctx_t *context)
+{
+    const sock_udp_ep_t *remote = coap_request_ctx_get_remote_udp(context);
+    size_t request_len = (pkt->payload - (uint8_t *)pkt->hdr) + pkt->payload_len;
+    uint16_t id = coap_get_id(pkt);
+
+    if (coapServerRequestIsMulticast()) {
+        return 0;
+    }
+    if (request_len > CONFIG_DID_CRYPTO_REQUEST_SIZE) {
+        return coap_build_reply(pkt, COAP_CODE_REQUEST_ENTITY_TOO_LARGE, buf, len, 0);
+    }
+
+    const uint8_t *token = coap_get_token(pkt);
+    unsigned token_len = coap_get_token_len(pkt);
+
+    mutex_lock(&crypto_jobs_lock);
+    for (unsigned i = 0; i < CONFIG_DID_CRYPTO_JOBS; i++) {
+        crypto_done *done = &crypto_done_jobs[i];
+        if (done->response_len > 0 && done->id == id && sock_udp_ep_equal(&done->remote, remote) &&
+            done->token_len == token_len && memcmp(done->token, token, token_len) == 0) {
+            //RETRANSMISSION OF A FINISHED REQUEST, ANSWERED WITHOUT RUNNING IT AGAIN
+            ssize_t res = 0;
+            if (coap_get_type(pkt) == COAP_TYPE_CON && done->response_len <= len) {
+                memcpy(buf, done->response, done->response_len);
+                res = done->response_len;
+            }
+            mutex_unlock(&crypto_jobs_lock);
+            return res;
+        }
+    }
+
+    bool queued = false;
+    for (unsigned i = 0; i < crypto_jobs_count; i++) {
+        crypto_job *job = &crypto_jobs[(crypto_jobs_first + i) % CONFIG_DID_CRYPTO_JOBS];
+        if (sock_udp_ep_equal(&job->remote, remote) && ntohs(((coap_hdr_t *)job->request)->id) == id) {
+            queued = true; //RETRANSMISSION OF A QUEUED REQUEST
+        }
+    }
+    if (!queued && crypto_jobs_count == CONFIG_DID_CRYPTO_JOBS) {
+        mutex_unlock(&crypto_jobs_lock);
+        return coap_build_reply(pkt, COAP_CODE_SERVICE_UNAVAILABLE, buf, len, 0);
+    }
+    if (!queued) {
+        crypto_job *job = &crypto_jobs[(crypto_jobs_first + crypto_jobs_count) % CONFIG_DID_CRYPTO_JOBS];
+        job->resource = context->resource;
+        job->remote = *remote;
+        memcpy(job->request, pkt->hdr, request_len);
+        job->request_len = request_len;
+        crypto_jobs_count++;
+    }
+    mutex_unlock(&crypto_jobs_lock);
+
+    msg_t msg = { .type = CRYPTO_MSG_JOB };
+    msg_try_send(&msg, crypto_pid);
+
+    if (coap_get_type(pkt) != COAP_TYPE_CON) {
+        return 0;
+    }
+    return coap_build_hdr((coap_hdr_t *)buf, COAP_TYPE_ACK, NULL, 0, COAP_CODE_EMPTY, id);
+}
+
+/** @brief  Tell the crypto worker that a separate response or notification was acknowledged or reset
+* @param[in] id message id of the ACK or RST
+* @param[in] reset the message was an RST, an observer that resets a notification is removed
+*/
+void didSeparateAck(uint16_t id, bool reset){
+    if (reset) {
+        removeDataObserver(id);
+    }
+    if (crypto_pid != KERNEL_PID_UNDEF) {
+        msg_t msg = { .type = CRYPTO_MSG_ACK, .content.value = id };
+        msg_try_send(&msg, crypto_pid);
+    }
+}
+
+/** @brief  Send a separate response or notification from the crypto worker
+* A confirmable message is kept in the pending table and retransmitted with
+* exponential back-off by retransmitSeparate until it is acknowledged or
+* CONFIG_COAP_MAX_RETRANSMIT is reached. Without a free slot it is sent once.
+* @param[in] message CoAP message with type and id set
+* @param[in] message_len length of message
+* @param[in] remote destination
+*/
+static void sendSeparate(const uint8_t* message, size_t message_len, const sock_udp_ep_t* remote)
+{
+    const coap_hdr_t *hdr = (const coap_hdr_t *)message;
+
+    coapServerSend(message, message_len, remote);
+    if (((hdr->ver_t_tkl >> 4) & 0x3) != COAP_TYPE_CON) {
+        return;
+    }
+
+    for (unsigned i = 0; i < CONFIG_DID_SEPARATE_PENDING; i++) {
+        separate_pending *pending = &separate_pendings[i];
+        if (!pending->active) {
+            pending->active = true;
+            pending->remote = *remote;
+            pending->id = ntohs(hdr->id);
+            memcpy(pending->message, message, message_len);
+            pending->message_len = message_len;
+            pending->timeout = CONFIG_COAP_ACK_TIMEOUT_MS * US_PER_MS;
+            pending->due = xtimer_now_usec() + pending->timeout;
+            pending->retransmissions = 0;
+            return;
+        }
+    }
+    printf("Message %u is not retransmitted, no pending slot\n", ntohs(hdr->id));
+}
+
+/** @brief  Stop retransmitting an acknowledged or reset message
+* @param[in] id message id
+*/
+static void separateAcked(uint16_t id)
+{
+    for (unsigned i = 0; i < CONFIG_DID_SEPARATE_PENDING; i++) {
+        if (separate_pendings[i].active && separate_pendings[i].id == id) {
+            separate_pendings[i].active = false;
+        }
+    }
+}
+
+/** @brief  Retransmit the pending messages that are due
+* A message that was not acknowledged after CONFIG_COAP_MAX_RETRANSMIT
+* retransmissions is dropped, an observer it was notified to is removed.
+* @returns microseconds until the next retransmission, UINT32_MAX if none is pending
+*/
+static uint32_t retransmitSeparate(void)
+{
+    uint32_t next = UINT32_MAX;
+    uint32_t now = xtimer_now_usec();
+
+    for (unsigned i = 0; i < CONFIG_DID_SEPARATE_PENDING; i++) {
+        separate_pending *pending = &separate_pendings[i];
+        if (!pending->active) {
+            continue;
+        }
+        int32_t left = (int32_t)(pending->due - now);
+        if (left <= 0) {
+            if (pending->retransmissions == CONFIG_COAP_MAX_RETRANSMIT) {
+                printf("Message %u was not acknowledged\n", pending->id);
+                pending->active = false;
+                removeDataObserver(pending->id);
+                continue;
+            }
+            coapServerSend(pending->message, pending->message_len, &pending->remote);
+            pending->retransmissions++;
+            pending->timeout *= 2;
+            pending->due = now + pending->timeout;
+            left = pending->timeout;
+        }
+        if ((uint32_t)left < next) {
+            next = left;
+        }
     }
+    return next;
 }
 
+/** @brief  Run the handler of a queued request and send its reply as separate response
+* The reply is also kept as the last finished job of the client.
+* @param[in] job queued request
+*/
+static void runCryptoJob(crypto_job* job){
+    coap_pkt_t pkt;
+    if (coap_parse(&pkt, job->request, job->request_len) < 0) {
+        return;
+    }
+
+    coap_request_ctx_t ctx = { .resource = job->resource, .context = job->resource->context, .remote = &job->remote };
+    ssize_t res = job->resource->handler(&pkt, crypto_response, sizeof(crypto_response), &ctx);
+    if (res <= 0) {
+        return;
+    }
+
+    mutex_lock(&crypto_jobs_lock);
+    crypto_done *done = &crypto_done_jobs[crypto_done_next];
+    for (unsigned i = 0; i < CONFIG_DID_CRYPTO_JOBS; i++) {
+        if (crypto_done_jobs[i].response_len > 0 && sock_udp_ep_equal(&crypto_done_jobs[i].remote, &job->remote)) {
+            done = &crypto_done_jobs[i];
+        }
+    }
+    if (done == &crypto_done_jobs[crypto_done_next]) {
+        crypto_done_next = (crypto_done_next + 1) % CONFIG_DID_CRYPTO_JOBS;
+    }
+    done->remote = job->remote;
+    done->id = coap_get_id(&pkt);
+    done->token_len = coap_get_token_len(&pkt);
+    memcpy(done->token, coap_get_token(&pkt), done->token_len);
+    memcpy(done->response, crypto_response, res);
+    done->response_len = res;
+    mutex_unlock(&crypto_jobs_lock);
+
+    unsigned type = (coap_get_type(&pkt) == COAP_TYPE_CON) ? COAP_TYPE_CON : COAP_TYPE_NON;
+    coap_hdr_set_type((coap_hdr_t *)crypto_response, type);
+    ((coap_hdr_t *)crypto_response)->id = htons(separate_id++);
+
+    sendSeparate(crypto_response, res, &job->remote);
+}
+
+static void* cryptoWorker(void* arg){
+    (void)arg;
+    msg_init_queue(crypto_msg_queue, CRYPTO_MSG_QUEUE_SIZE);
+
+    //THE FIRST DID IS READY BEFORE THE FIRST REQUEST NEEDS IT
+    mutex_lock(&did_lock);
+    if (deviceDid == NULL) {
+        createDeviceDid();
+    }
+    mutex_unlock(&did_lock);
+
+    armDataSampling();
+
+    while (1) {
+        msg_t msg;
+        uint32_t timeout = retransmitSeparate();
+        if (timeout == UINT32_MAX) {
+            msg_receive(&msg);
+        }
+        else if (xtimer_msg_receive_timeout(&msg, timeout) < 0) {
+            continue; //A RETRANSMISSION IS DUE
+        }
+
+        if (msg.type == CRYPTO_MSG_SAMPLE) {
+            sample_pending = true;
+        }
+        if (msg.type == CRYPTO_MSG_ACK) {
+            separateAcked(msg.content.value);
+        }
+
+        while (1) {
+            mutex_lock(&crypto_jobs_lock);
+            crypto_job *job = (crypto_jobs_count > 0) ? &crypto_jobs[crypto_jobs_first] : NULL;
+            mutex_unlock(&crypto_jobs_lock);
+
+            if (job == NULL) {
+                break;
+            }
+            runCryptoJob(job);
+
+            mutex_lock(&crypto_jobs_lock);
+            crypto_jobs_first = (crypto_jobs_first + 1) % CONFIG_DID_CRYPTO_JOBS;
+            crypto_jobs_count--;
+            mutex_unlock(&crypto_jobs_lock);
+        }
+
+        if (sample_pending) {
+            sample_pending = false;
+            notifyDataObservers();
+            armDataSampling();
+        }
+    }
+
+    return NULL;
+}
+
+/** @brief  Start the crypto worker thread */
+void didCryptoWorkerStart(void){
+    separate_id = random_uint32();
+    data_readings = random_uint32();
+    crypto_pid = thread_create(crypto_stack, sizeof(crypto_stack), THREAD_PRIORITY_MAIN + 1,
+                               THREAD_CREATE_STACKTEST, cryptoWorker, NULL, "did_crypto");
+}
 //----------------------------------------------------------------
 
 static ssize_t _riot_board_handler(coap_pkt_t *pkt, uint8_t *buf, size_t len, coap_request_ctx_t *context)
 {
     (void)context;
-    return coap_reply_simple(pkt, COAP_CODE_205, buf, len,
-            COAP_FORMAT_TEXT, (uint8_t*)RIOT_BOARD, strlen(RIOT_BOARD));
+    reply_options opts = { .etag = NULL, .observe = -1, .max_age = CONFIG_DID_BOARD_MAX_AGE };
+    return replyBlockwiseOpts(pkt, buf, len,
+            COAP_FORMAT_TEXT, RIOT_BOARD, strlen(RIOT_BOARD), &opts);
 }
 
 
 /** @brief  Create Public/Private Key Pair
+ *  @param  arena: arena of the DID generation the keys belong to
  *  @param  keyPair: pointer to key_pair struct to store keys
  */
-void createKeysEd25519(key_pair* keyPair){
+void createKeysEd25519(did_arena* arena, key_pair* keyPair){
 
-    if (keyPair->secret_key_bytes == NULL) {
-        keyPair->secret_key_bytes = calloc(EDSIGN_SECRET_KEY_SIZE, sizeof(uint8_t));
-        keyPair->public_key_bytes = calloc(EDSIGN_PUBLIC_KEY_SIZE, sizeof(uint8_t));
+    keyPair->secret_key_bytes = arenaAlloc(arena, DID_CRYPTO_SECRET_KEY_SIZE);
+    keyPair->public_key_bytes = arenaAlloc(arena, DID_CRYPTO_PUBLIC_KEY_SIZE);
+    keyPair->signer = arenaAlloc(arena, sizeof(did_sign_context));
 
-        random_bytes(keyPair->secret_key_bytes, sizeof(keyPair->secret_key_bytes));
-    }
-    else {
-        keyPair->public_key_bytes = calloc(EDSIGN_PUBLIC_KEY_SIZE, sizeof(uint8_t));
-    }
-    
-    ed25519_prepare(keyPair->secret_key_bytes);
-    edsign_sec_to_pub(keyPair->public_key_bytes, keyPair->secret_key_bytes);
+    didCryptoGenerate(keyPair->signer, keyPair->secret_key_bytes, keyPair->public_key_bytes);
 
     /* Print the new keypair */ //Prints the hex to compare with base64
     puts("New keypair generated(PRINT IN HEX TO VERIFY WITH BASE64):");
     printf("  - Secret key hex: ");
-    for (uint8_t i = 0; i < EDSIGN_SECRET_KEY_SIZE; ++i)
+    for (uint8_t i = 0; i < DID_CRYPTO_SECRET_KEY_SIZE; ++i)
         printf("%02X", keyPair->secret_key_bytes[i]);
     printf("\n  - Public key hex: ");
-    for (uint8_t i = 0; i < EDSIGN_PUBLIC_KEY_SIZE; ++i)
+    for (uint8_t i = 0; i < DID_CRYPTO_PUBLIC_KEY_SIZE; ++i)
         printf("%02X", keyPair->public_key_bytes[i]);
     puts("");
 
     
     //SAVE KEYS TO BASE64
-    keyPair->public_key_base64 = calloc(100, sizeof(char));
-    bytes_to_base64url(keyPair->public_key_bytes, EDSIGN_PUBLIC_KEY_SIZE, keyPair->public_key_base64);
+    keyPair->public_key_base64 = arenaAlloc(arena, base64_estimate_encode_size(DID_CRYPTO_PUBLIC_KEY_SIZE) + 1);
+    bytes_to_base64url(keyPair->public_key_bytes, DID_CRYPTO_PUBLIC_KEY_SIZE, keyPair->public_key_base64);
 
-    keyPair->secret_key_base64 = calloc(100, sizeof(char));
-    bytes_to_base64url(keyPair->secret_key_bytes, EDSIGN_SECRET_KEY_SIZE, keyPair->secret_key_base64);
+    keyPair->secret_key_base64 = arenaAlloc(arena, base64_estimate_encode_size(DID_CRYPTO_SECRET_KEY_SIZE) + 1);
+    bytes_to_base64url(keyPair->secret_key_bytes, DID_CRYPTO_SECRET_KEY_SIZE, keyPair->secret_key_base64);
 
     printf("  - Secret key base64: %s\n", keyPair->secret_key_base64);
     printf("  - Public key base64: %s\n", keyPair->public_key_base64);
@@ -437,129 +1697,589 @@ void createKeysEd25519(key_pair* keyPair){
 // }
 
 
-/** @brief  Sign message with secret key and return nessage_base64.signature
-* @param[in] message to sign
-* @param[in] message_len length of message
-* @param[in] secret_key secret key
-* @param[in] public_key public key
-* @returns message with signature as string => "message,signature"
+#define TEMPERATURE_EXAMPLE     (25)
+#define SCALE_EXAMPLE           "C"
+
+/** @brief  Sensor reading, the example temperature */
+static int readTemperature(void){
+    return TEMPERATURE_EXAMPLE;
+}
+
+/** @brief  Base64url JSON of a reading
+* @param[out] out DATA_READING_BASE64_SIZE bytes, NULL terminated
+* @param[in] temperature sampled value
+* @param[in] seq sequence number, only written for epoch readings
+* @param[in] with_seq write seq
+* @returns length of out
 */
-char* signMessageAndReturnMessageWithSignature(uint8_t* message, uint16_t message_len, uint8_t* secret_key, uint8_t* public_key) // USED IN SIGN HANDLER
-{ 
+static size_t readingToBase64url(char* out, int temperature, uint32_t seq, bool with_seq){
+    did_writer w;
+
+    writerInit(&w, out, DATA_READING_BASE64_SIZE, NULL);
+    writerBase64url(&w, true);
+    writerCat(&w, "{\"temperature\":", NULL);
+    writerS32(&w, temperature);
+    writerCat(&w, ",\"scale\":\"", SCALE_EXAMPLE, "\"", NULL);
+    if (with_seq) {
+        writerCat(&w, ",\"seq\":", NULL);
+        writerU32(&w, seq);
+    }
+    writerCat(&w, "}", NULL);
+    return writerFinish(&w);
+}
 
-    char *signature_base64 = sign_message(message, message_len, secret_key, public_key);
+/** @brief  Store "did_response data_base64url.signature" as the text reply of /riot/data
+* @param[in] data reading as base64url JSON
+* @param[in] signature_base64 signature of data as base64url
+*/
+static void storeDataResponse(const char* data, const char* signature_base64){
+    did_writer w;
 
-    //Create response with signature
-    char *response = calloc(strlen(signature_base64) + 1 + message_len, sizeof(char));
-    memcpy(response, message, message_len);
-    memcpy(response + message_len, ".", 1);
-    memcpy(response + message_len + 1, signature_base64, strlen(signature_base64));
+    writerInit(&w, data_response, sizeof(data_response), NULL);
+    writerWrite(&w, did_response, did_response_len);
+    writerCat(&w, " ", data, ".", signature_base64, NULL);
+    data_response_len = writerFinish(&w);
+}
 
-    free(signature_base64);
-    
-    return response;
+/** @brief  Merkle inclusion proof of a reading in its epoch */
+typedef struct {
+    uint32_t seq;           //SEQUENCE NUMBER OF THE READING
+    unsigned index;         //LEAF INDEX IN THE EPOCH
+    const uint8_t* path;    //SIBLING HASHES FROM THE LEAF UP TO THE ROOT
+    size_t path_len;
+} epoch_proof;
+
+/** @brief  Store [document, proof, {"payload": reading, "signature": bstr}] as the CBOR reply of /riot/data
+* The signature still covers the base64url JSON reading, which the gateway rebuilds from the payload map.
+* With an epoch proof the payload also holds "seq", the map gets "index" and "path" and
+* the signature is the one of the epoch root.
+* @param[in] temperature sampled value, the one in the signed JSON reading
+* @param[in] signature_base64 signature of reading (or of its epoch root) as base64url
+* @param[in] epoch inclusion proof of the reading, NULL if the reading is signed on its own
+*/
+static void storeDataCborResponse(int temperature, const char* signature_base64, const epoch_proof* epoch){
+    nanocbor_encoder_t enc;
+
+    nanocbor_encoder_init(&enc, data_cbor_response, sizeof(data_cbor_response));
+    nanocbor_fmt_array(&enc, 3);
+    int res = didToCbor(&enc, deviceDid);
+
+    nanocbor_fmt_map(&enc, epoch ? 4 : 2);
+    nanocbor_put_tstr(&enc, "payload");
+    nanocbor_fmt_map(&enc, epoch ? 3 : 2);
+    nanocbor_put_tstr(&enc, "temperature");
+    nanocbor_fmt_int(&enc, temperature);
+    nanocbor_put_tstr(&enc, "scale");
+    nanocbor_put_tstr(&enc, SCALE_EXAMPLE);
+    if (epoch) {
+        nanocbor_put_tstr(&enc, "seq");
+        nanocbor_fmt_uint(&enc, epoch->seq);
+        nanocbor_put_tstr(&enc, "index");
+        nanocbor_fmt_uint(&enc, epoch->index);
+        nanocbor_put_tstr(&enc, "path");
+        nanocbor_put_bstr(&enc, epoch->path, epoch->path_len);
+    }
+    nanocbor_put_tstr(&enc, "signature");
+    res |= putBase64urlAsBstr(&enc, signature_base64);
+
+    data_cbor_response_len = (res == 0) ? finishCbor(&enc, sizeof(data_cbor_response)) : 0;
 }
 
-char* getTemperatureExample(void) {
-    char *temperature = calloc(32, sizeof(char));
-    memcpy(temperature, "{\"temperature\":25,\"scale\":\"C\"}", 31);
+/** @brief  Store the COSE_Sign1 of the CBOR reading as the COSE reply of /riot/data
+* The DID is not repeated, the kid tells the gateway which DID signed it.
+* @param[in] temperature sampled value
+*/
+static void storeDataCoseResponse(int temperature){
+    uint8_t reading[48];
+    nanocbor_encoder_t enc;
+
+    nanocbor_encoder_init(&enc, reading, sizeof(reading));
+    nanocbor_fmt_map(&enc, 2);
+    nanocbor_put_tstr(&enc, "temperature");
+    nanocbor_fmt_int(&enc, temperature);
+    nanocbor_put_tstr(&enc, "scale");
+    nanocbor_put_tstr(&enc, SCALE_EXAMPLE);
+    size_t reading_len = finishCbor(&enc, sizeof(reading));
+
+    data_cose_response_len = coseSign1(data_cose_response, sizeof(data_cose_response), did_kid, sizeof(did_kid),
+                                       reading, reading_len, document_key_pair);
+}
+
+//EPOCH-BATCHED DATA SIGNATURES (MERKLE TREE) ---------------------
+// The readings of an epoch are sampled together when it opens, hashed into a
+// SHA-256 Merkle tree and only the root is signed with the document key. Each
+// GET then serves the next reading with its index and the sibling hashes up to
+// the root, so the gateway checks the root signature once per epoch and only
+// hashes for the other readings.
+// Leaves are SHA256(0x00 || reading_base64url), nodes SHA256(0x01 || left || right).
+#define MERKLE_LEAF_PREFIX      (0x00)
+#define MERKLE_NODE_PREFIX      (0x01)
+
+/* Node 1 is the root, the children of node i are 2i and 2i+1 and the leaves
+ * are nodes DATA_EPOCH_LEAVES to 2 * DATA_EPOCH_LEAVES - 1 */
+static uint8_t epoch_tree[2 * DATA_EPOCH_LEAVES][SHA256_DIGEST_LENGTH];
+static int epoch_temperature[DATA_EPOCH_LEAVES];
+static char epoch_root_signature[SIGNATURE_BASE64_SIZE];
+static uint32_t epoch_first_seq = 0;
+static uint32_t data_seq = 0;                   //SEQ OF THE NEXT SAMPLED READING
+static unsigned epoch_next = DATA_EPOCH_LEAVES; //NEXT READING TO SERVE, USED UP AT DATA_EPOCH_LEAVES
+
+/** @brief  Base64url JSON of an epoch reading
+* @param[out] out DATA_READING_BASE64_SIZE bytes, NULL terminated
+* @param[in] index reading of the current epoch
+*/
+static void epochReading(char* out, unsigned index){
+    readingToBase64url(out, epoch_temperature[index], epoch_first_seq + index, true);
+}
 
-    char* temperature_base64 = calloc(50, sizeof(char));
-    bytes_to_base64url(temperature, strlen(temperature), temperature_base64);
+/** @brief  Hash a reading into a leaf of the epoch tree */
+static void merkleLeaf(uint8_t* out, const char* reading){
+    static const uint8_t prefix = MERKLE_LEAF_PREFIX;
+    sha256_context_t ctx;
 
-    return temperature_base64;
+    sha256_init(&ctx);
+    sha256_update(&ctx, &prefix, 1);
+    sha256_update(&ctx, reading, strlen(reading));
+    sha256_final(&ctx, out);
 }
 
+/** @brief  Hash two children into their parent node of the epoch tree */
+static void merkleNode(uint8_t* out, const uint8_t* left, const uint8_t* right){
+    static const uint8_t prefix = MERKLE_NODE_PREFIX;
+    sha256_context_t ctx;
+
+    sha256_init(&ctx);
+    sha256_update(&ctx, &prefix, 1);
+    sha256_update(&ctx, left, SHA256_DIGEST_LENGTH);
+    sha256_update(&ctx, right, SHA256_DIGEST_LENGTH);
+    sha256_final(&ctx, out);
+}
+
+/** @brief  Sample the readings of a new epoch, build its tree and sign the root */
+static void openDataEpoch(void){
+    char reading[DATA_READING_BASE64_SIZE];
+
+    epoch_first_seq = data_seq;
+    data_seq += DATA_EPOCH_LEAVES;
+
+    for (unsigned i = 0; i < DATA_EPOCH_LEAVES; i++) {
+        epoch_temperature[i] = readTemperature();
+        epochReading(reading, i);
+        merkleLeaf(epoch_tree[DATA_EPOCH_LEAVES + i], reading);
+    }
+    for (unsigned i = DATA_EPOCH_LEAVES - 1; i > 0; i--) {
+        merkleNode(epoch_tree[i], epoch_tree[2 * i], epoch_tree[2 * i + 1]);
+    }
+
+    sign_message(epoch_root_signature, epoch_tree[1], SHA256_DIGEST_LENGTH, document_key_pair->signer);
+
+    epoch_next = 0;
+}
+
+/** @brief  Serve the next reading of the epoch with its inclusion proof
+* Opens a new epoch when the current one is used up.
+* @param[in] format COAP_FORMAT_TEXT or COAP_FORMAT_CBOR
+*/
+static void storeEpochDataResponse(int format){
+    if (epoch_next >= DATA_EPOCH_LEAVES) {
+        openDataEpoch();
+    }
+
+    unsigned index = epoch_next++;
+    uint8_t path[DATA_EPOCH_PATH_SIZE + 1];
+    size_t path_len = 0;
+    for (unsigned node = DATA_EPOCH_LEAVES + index; node > 1; node /= 2) {
+        memcpy(path + path_len, epoch_tree[node ^ 1], SHA256_DIGEST_LENGTH);
+        path_len += SHA256_DIGEST_LENGTH;
+    }
+
+    if (format == COAP_FORMAT_CBOR) {
+        epoch_proof epoch = { epoch_first_seq + index, index, path, path_len };
+        storeDataCborResponse(epoch_temperature[index], epoch_root_signature, &epoch);
+        return;
+    }
+
+    //"data_base64url.index.path_base64url.root_signature"
+    char reading[DATA_READING_BASE64_SIZE];
+    epochReading(reading, index);
+
+    char proof[DATA_EPOCH_PROOF_SIZE + sizeof(epoch_root_signature)];
+    did_writer w;
+    writerInit(&w, proof, sizeof(proof), NULL);
+    writerU32(&w, index);
+    writerCat(&w, ".", NULL);
+    writerBase64url(&w, true);
+    writerWrite(&w, path, path_len);
+    writerBase64url(&w, false);
+    writerCat(&w, ".", epoch_root_signature, NULL);
+    writerFinish(&w);
+
+    storeDataResponse(reading, proof);
+}
+//----------------------------------------------------------------
+
+/** @brief  Number of the reading stored for a content format
+* @param[in] format COAP_FORMAT_TEXT, COAP_FORMAT_CBOR or COAP_FORMAT_COSE_SIGN1
+* @returns pointer to the number
+*/
+static uint32_t* dataResponseTag(int format){
+    if (format == COAP_FORMAT_CBOR) {
+        return &data_cbor_response_tag;
+    }
+    if (format == COAP_FORMAT_COSE_SIGN1) {
+        return &data_cose_response_tag;
+    }
+    return &data_response_tag;
+}
+
+/** @brief  ETag of the reading stored for a content format
+* @param[out] etag DATA_ETAG_SIZE bytes
+* @param[in] format COAP_FORMAT_TEXT, COAP_FORMAT_CBOR or COAP_FORMAT_COSE_SIGN1
+*/
+static void dataEtag(uint8_t* etag, int format){
+    byteorder_htobebufl(etag, *dataResponseTag(format));
+    etag[DATA_ETAG_SIZE - 1] = format;
+}
+
+/** @brief  Response buffer of /riot/data for a content format
+* @param[in] format COAP_FORMAT_TEXT, COAP_FORMAT_CBOR or COAP_FORMAT_COSE_SIGN1
+* @param[out] response_len length of the stored response, 0 if there is none
+* @returns stored response
+*/
+static const void* dataResponse(int format, size_t* response_len){
+    if (format == COAP_FORMAT_CBOR) {
+        *response_len = data_cbor_response_len;
+        return data_cbor_response;
+    }
+    if (format == COAP_FORMAT_COSE_SIGN1) {
+        *response_len = data_cose_response_len;
+        return data_cose_response;
+    }
+    *response_len = data_response_len;
+    return data_response;
+}
+
+/** @brief  Sign a new reading into the response buffer of a content format
+* Readings of an epoch were sampled when it opened, temperature is only used
+* for readings signed on their own.
+* @param[in] format COAP_FORMAT_TEXT, COAP_FORMAT_CBOR or COAP_FORMAT_COSE_SIGN1
+* @param[in] temperature sampled value
+*/
+static void storeDataReading(int format, int temperature){
+    if (format == COAP_FORMAT_COSE_SIGN1) {
+        storeDataCoseResponse(temperature);
+    }
+    else if (CONFIG_DID_DATA_EPOCH_SIZE > 0) {
+        storeEpochDataResponse(format);
+    }
+    else {
+        char data[DATA_READING_BASE64_SIZE];
+        size_t data_len = readingToBase64url(data, temperature, 0, false);
+        char signature_base64[SIGNATURE_BASE64_SIZE];
+        sign_message(signature_base64, (uint8_t *)data, data_len, document_key_pair->signer);
+
+        if (format == COAP_FORMAT_CBOR) {
+            storeDataCborResponse(temperature, signature_base64, NULL);
+        }
+        else {
+            storeDataResponse(data, signature_base64);
+        }
+    }
+    *dataResponseTag(format) = ++data_readings;
+}
+
+//OBSERVE /riot/data (RFC 7641) -----------------------------------
+// A GET with Observe 0 registers the client. The crypto worker samples the
+// sensor every CONFIG_DID_OBSERVE_SAMPLE_MS and pushes a newly signed reading
+// to the observers when the value changed or CONFIG_DID_OBSERVE_INTERVAL_S
+// passed since the last notification. Every CONFIG_DID_OBSERVE_CON_EVERY-th
+// notification is confirmable, an observer that does not acknowledge it or
+// answers a notification with RST is removed. Observers that asked for the
+// same content format get the same signed reading. Notifications carry the
+// first block and the ETag of the reading, the client fetches the rest with
+// GET, and a Max-Age of CONFIG_DID_OBSERVE_INTERVAL_S since the next one comes
+// before then.
+#ifndef CONFIG_DID_OBSERVERS
+#define CONFIG_DID_OBSERVERS            (2U)
+#endif
+#ifndef CONFIG_DID_OBSERVE_SAMPLE_MS
+#define CONFIG_DID_OBSERVE_SAMPLE_MS    (5000U)
+#endif
+#ifndef CONFIG_DID_OBSERVE_INTERVAL_S
+#define CONFIG_DID_OBSERVE_INTERVAL_S   (60U)
+#endif
+#ifndef CONFIG_DID_OBSERVE_CON_EVERY
+#define CONFIG_DID_OBSERVE_CON_EVERY    (8U)
+#endif
+
+typedef struct {
+    bool active;
+    sock_udp_ep_t remote;
+    uint8_t token[COAP_TOKEN_LENGTH_MAX];
+    uint8_t token_len;
+    int format;             //CONTENT FORMAT ASKED FOR AT REGISTRATION
+    uint16_t last_id;       //MESSAGE ID OF THE LAST NOTIFICATION
+} data_observer;
+
+static data_observer data_observers[CONFIG_DID_OBSERVERS];
+static mutex_t observers_lock = MUTEX_INIT;
+static uint32_t observe_seq = 0;
+static int observed_temperature;
+static unsigned samples_since_notify = 0;
+static unsigned notifications = 0;
+
+static xtimer_t sample_timer;
+static msg_t sample_msg = { .type = CRYPTO_MSG_SAMPLE };
+
+/** @brief  Wake the crypto worker for the next sample */
+static void armDataSampling(void){
+    xtimer_set_msg(&sample_timer, CONFIG_DID_OBSERVE_SAMPLE_MS * US_PER_MS, &sample_msg, crypto_pid);
+}
+
+/** @brief  Register or deregister the client of a GET /riot/data with an Observe option
+* @param[in] pkt request
+* @param[in] remote client
+* @param[in] format content format of the notifications
+* @returns value of the Observe option of the reply, -1 if the client is not registered
+*/
+static int32_t updateDataObserver(coap_pkt_t *pkt, const sock_udp_ep_t *remote, int format){
+    if (!coap_has_observe(pkt)) {
+        return -1;
+    }
+
+    const uint8_t *token = coap_get_token(pkt);
+    unsigned token_len = coap_get_token_len(pkt);
+    data_observer *slot = NULL;
+    int32_t observe = -1;
+
+    mutex_lock(&observers_lock);
+    for (unsigned i = 0; i < CONFIG_DID_OBSERVERS; i++) {
+        data_observer *observer = &data_observers[i];
+        if (observer->active && sock_udp_ep_equal(&observer->remote, remote) &&
+            observer->token_len == token_len && memcmp(observer->token, token, token_len) == 0) {
+            observer->active = false;
+        }
+        if (!observer->active && slot == NULL) {
+            slot = observer;
+        }
+    }
+    if (coap_get_observe(pkt) == COAP_OBS_REGISTER && slot != NULL) {
+        slot->active = true;
+        slot->remote = *remote;
+        memcpy(slot->token, token, token_len);
+        slot->token_len = token_len;
+        slot->format = format;
+        observe = observe_seq;
+    }
+    mutex_unlock(&observers_lock);
+
+    return observe;
+}
+
+/** @brief  Remove the observer whose last notification had this message id
+* @param[in] id message id
+*/
+static void removeDataObserver(uint16_t id){
+    mutex_lock(&observers_lock);
+    for (unsigned i = 0; i < CONFIG_DID_OBSERVERS; i++) {
+        if (data_observers[i].active && data_observers[i].last_id == id) {
+            data_observers[i].active = false;
+            printf("Observer %u removed\n", i);
+        }
+    }
+    mutex_unlock(&observers_lock);
+}
+
+/** @brief  Build a notification with the first block of a /riot/data response
+* @param[out] buf message buffer
+* @param[in] observer observer to notify
+* @param[in] type COAP_TYPE_CON or COAP_TYPE_NON
+* @param[in] id message id
+* @param[in] etag DATA_ETAG_SIZE bytes of ETag of the stored response
+* @param[in] payload stored response in the format of the observer
+* @param[in] payload_len length of stored response
+* @returns length of notification
+*/
+static size_t buildDataNotification(uint8_t* buf, const data_observer* observer, unsigned type, uint16_t id,
+                                    const uint8_t* etag, const void* payload, size_t payload_len){
+    coap_block_slicer_t slicer;
+    coap_block_slicer_init(&slicer, 0, coap_szx2size(CONFIG_DID_BLOCK_SZX));
+
+    uint8_t *bufpos = buf + coap_build_hdr((coap_hdr_t *)buf, type, observer->token, observer->token_len, COAP_CODE_205, id);
+    bufpos += coap_put_option(bufpos, 0, COAP_OPT_ETAG, etag, DATA_ETAG_SIZE);
+    bufpos += coap_opt_put_uint(bufpos, COAP_OPT_ETAG, COAP_OPT_OBSERVE, observe_seq);
+    bufpos += coap_put_option_ct(bufpos, COAP_OPT_OBSERVE, observer->format);
+    bufpos += coap_opt_put_uint(bufpos, COAP_OPT_CONTENT_FORMAT, COAP_OPT_MAX_AGE, CONFIG_DID_OBSERVE_INTERVAL_S);
+    bufpos += coap_opt_put_block2(bufpos, COAP_OPT_MAX_AGE, &slicer, 1);
+    *bufpos++ = 0xff;
+    bufpos += coap_blockwise_put_bytes(&slicer, bufpos, payload, payload_len);
+    coap_block2_finish(&slicer);
+
+    return bufpos - buf;
+}
+
+/** @brief  Sample the sensor and notify the observers of /riot/data if needed */
+static void notifyDataObservers(void){
+    int temperature = readTemperature();
+
+    samples_since_notify++;
+    if (temperature == observed_temperature &&
+        samples_since_notify * CONFIG_DID_OBSERVE_SAMPLE_MS < CONFIG_DID_OBSERVE_INTERVAL_S * 1000U) {
+        return;
+    }
+
+    observed_temperature = temperature;
+    samples_since_notify = 0;
+    observe_seq = (observe_seq + 1) & 0xffffff;
+    unsigned type = (++notifications % CONFIG_DID_OBSERVE_CON_EVERY == 0) ? COAP_TYPE_CON : COAP_TYPE_NON;
+    unsigned signed_formats = 0; //FORMATS SIGNED IN THIS ROUND, ONE BIT PER FORMAT
+
+    for (unsigned i = 0; i < CONFIG_DID_OBSERVERS; i++) {
+        mutex_lock(&observers_lock);
+        data_observer observer = data_observers[i];
+        uint16_t id = 0;
+        if (observer.active) {
+            id = separate_id++;
+            data_observers[i].last_id = id;
+        }
+        mutex_unlock(&observers_lock);
+
+        if (!observer.active) {
+            continue;
+        }
+
+        //ONE NEWLY SIGNED READING PER FORMAT AND ROUND, SO OBSERVERS FETCHING LATER
+        //BLOCKS ALL CUT THEM FROM IT
+        unsigned format_bit = (observer.format == COAP_FORMAT_CBOR) ? 2 :
+                              (observer.format == COAP_FORMAT_COSE_SIGN1) ? 4 : 1;
+        mutex_lock(&did_lock);
+        if (!(signed_formats & format_bit)) {
+            storeDataReading(observer.format, temperature);
+            signed_formats |= format_bit;
+        }
+        size_t response_len;
+        uint8_t etag[DATA_ETAG_SIZE];
+        const void *response = dataResponse(observer.format, &response_len);
+        dataEtag(etag, observer.format);
+        size_t len = buildDataNotification(crypto_response, &observer, type, id, etag, response, response_len);
+        mutex_unlock(&did_lock);
+
+        if (response_len > 0) {
+            sendSeparate(crypto_response, len, &observer.remote);
+        }
+    }
+}
+//----------------------------------------------------------------
+
 // /* -- COAP REQUEST --
-// REQUEST: coap-client -m post coap://[fe80::7cde:caff:fe7f:ca57%tap0]/riot/sign -e message
-// RESPONSE: message,/bbM2225+nZeRJ6aA6xmGJdM2Bbc3qFNXpBjzdK8l8PiQGgiqDLHMRuIZO9ZF6qksvo7yvZOBKd9nuCDSgeaBg==
+// REQUEST: coap-client -m get coap://[fe80::7cde:caff:fe7f:ca57%tap0]/riot/data
+// RESPONSE: document_base64url proof_base64url data_base64url.signature
 // */
-/** @brief  Sign message with hardcoded keys
+/** @brief  Sign a reading with the DID document key and send it with the DID
+* A GET with Observe 0 also registers the client for notifications. Every block
+* carries the ETag of the reading it was cut from, a request for a later block
+* with the ETag of an older reading is answered with 4.08.
 * @param COAP-PARAMETERS
-* @returns message with signature as string ("message,signature")
+* @returns DID and signed reading, as text ("did data.signature") or CBOR,
+*          or only the reading as COSE_Sign1
 */
 static ssize_t sendDataVerifiableWithDid(coap_pkt_t *pkt, uint8_t *buf, size_t len, coap_request_ctx_t *context)
 {
-    (void)context;
-    char *data = getTemperatureExample();
+    int format = _accepted_format(pkt);
+    if (format < 0) {
+        return coap_build_reply(pkt, COAP_CODE_NOT_ACCEPTABLE, buf, len, 0);
+    }
+
+    if (!didLock(deviceDid == NULL)) {
+        return deferToWorker(pkt, buf, len, context);
+    }
+
+    //A NEW READING IS SIGNED FOR THE FIRST BLOCK ONLY, LATER BLOCKS ARE CUT FROM THE SAME RESPONSE.
+    //DECIDED UNDER did_lock, SO THE WORKER CANNOT USE UP THE EPOCH OR ROTATE THE DID IN BETWEEN
+    size_t response_len;
+    dataResponse(format, &response_len);
 
-    char *dataSigned = signMessageAndReturnMessageWithSignature((uint8_t *)data, strlen(data), document_key_pair->secret_key_bytes, document_key_pair->public_key_bytes);
+    coap_block1_t block2;
+    bool new_reading = !coap_get_block2(pkt, &block2) || block2.blknum == 0 || response_len == 0;
+    bool signs = new_reading && (format == COAP_FORMAT_COSE_SIGN1 || CONFIG_DID_DATA_EPOCH_SIZE == 0 ||
+                                 epoch_next >= DATA_EPOCH_LEAVES);
 
-    char *did_base64 = didToStringAsBase64(deviceDid);
+    if ((deviceDid == NULL || signs) && !didMaySign()) {
+        mutex_unlock(&did_lock);
+        return deferToWorker(pkt, buf, len, context);
+    }
+
+    uint8_t etag[DATA_ETAG_SIZE];
+    uint8_t *asked_etag;
+    if (!new_reading && coap_opt_get_opaque(pkt, COAP_OPT_ETAG, &asked_etag) > 0) {
+        dataEtag(etag, format);
+        if (!_etag_matches(pkt, etag, sizeof(etag))) {
+            //THE READING OF THE EARLIER BLOCKS WAS SIGNED OVER
+            mutex_unlock(&did_lock);
+            return coap_build_reply(pkt, COAP_CODE_REQUEST_ENTITY_INCOMPLETE, buf, len, 0);
+        }
+    }
 
-    char *response = calloc(strlen(dataSigned) + 1 + strlen(did_base64), sizeof(char));
-    memcpy(response, did_base64, strlen(did_base64));
-    memcpy(response + strlen(did_base64), " ", 1);
-    memcpy(response + strlen(did_base64) + 1, dataSigned, strlen(dataSigned));
+    if (deviceDid == NULL) {
+        createDeviceDid();
+    }
 
-    printf("\nResponse: %s\n", response);
+    int32_t observe = -1;
+    if (new_reading) {
+        storeDataReading(format, readTemperature());
+        observe = updateDataObserver(pkt, coap_request_ctx_get_remote_udp(context), format);
+    }
 
     //send back message and signature
-    return coap_reply_simple(pkt, COAP_CODE_205, buf, len+1024,
-            COAP_FORMAT_TEXT, response, strlen(response));
+    const void *response = dataResponse(format, &response_len);
+    if (response_len == 0) {
+        mutex_unlock(&did_lock);
+        return coap_build_reply(pkt, COAP_CODE_INTERNAL_SERVER_ERROR, buf, len, 0);
+    }
+    dataEtag(etag, format);
+    reply_options opts = { .etag = etag, .etag_len = sizeof(etag), .observe = observe, .max_age = DID_DATA_MAX_AGE };
+    ssize_t res = replyBlockwiseOpts(pkt, buf, len, format, response, response_len, &opts);
+    mutex_unlock(&did_lock);
+
+    return res;
 }
 
 /** @brief  Creates a DID including DID Document and Proof
+* The new DID generation is built in the spare arena and only replaces the
+* served one once it is complete. The retired generation is then torn down.
 * @return Saves Result in deviceDid global variable and returns it
 */
 did* createDeviceDid(void)
 {
-    deleteKeyPair(proof_key_pair);
-    deleteKeyPair(document_key_pair);
-    deleteDid(deviceDid);
+    did_arena* arena = next_arena;
+    arenaReset(arena);
 
-    proof_key_pair = calloc(1, sizeof(key_pair));
-    createKeysEd25519(proof_key_pair);
-    document_key_pair = calloc(1, sizeof(key_pair));
-    createKeysEd25519(document_key_pair);
+    key_pair* newProofKeyPair = arenaAlloc(arena, sizeof(key_pair));
+    createKeysEd25519(arena, newProofKeyPair);
+    key_pair* newDocumentKeyPair = arenaAlloc(arena, sizeof(key_pair));
+    createKeysEd25519(arena, newDocumentKeyPair);
 
-    //CREATE PROOF KEY
-    char* okp = calloc(3, sizeof(char));
-    memcpy(okp, "OKP", 3);
-    char* crv = calloc(7, sizeof(char));
-    memcpy(crv, "Ed25519", 7);
-
-    jwk* myProofJwk = createJwk(okp, crv, proof_key_pair->public_key_base64);
-    printf("%s\n", jwkToString(myProofJwk));
+    uint8_t digest[SHA256_DIGEST_LENGTH];
 
+    //CREATE PROOF KEY
+    jwk* myProofJwk = createJwk(arena, DID_KTY, DID_CRV, newProofKeyPair->public_key_base64);
 
     //CREATE PROOF HEADER
-    char* alg = calloc(5, sizeof(char));
-    memcpy(alg, "EdDSA", 5);
-
-    did_proof_header* myDidProofHeader = createDidProofHeader(alg, myProofJwk);
-    printf("%s\n", didProofHeaderToString(myDidProofHeader));
-
+    did_proof_header* myDidProofHeader = createDidProofHeader(arena, DID_ALG, myProofJwk);
 
     //CREATE ATTESTATION
-    char* attestationID = calloc(5, sizeof(char));
-    memcpy(attestationID, "#key1", 5);
-    char* attestationType = calloc(15, sizeof(char));
-    memcpy(attestationType, "JsonWebKey2020", 15);
-
-    char* okp2 = calloc(3, sizeof(char));
-    memcpy(okp2, "OKP", 3);
-    char* crv2 = calloc(7, sizeof(char));
-    memcpy(crv2, "Ed25519", 7);
-
-    jwk* myDocumentJwk = createJwk(okp2, crv2, document_key_pair->public_key_base64);
-    printf("%s\n", jwkToString(myDocumentJwk));
-
-    attestation* myattestation = createAttestation(attestationID, attestationType, myDocumentJwk);
-    printf("%s\n", attestationToString(myattestation));
+    jwk* myDocumentJwk = createJwk(arena, DID_KTY, DID_CRV, newDocumentKeyPair->public_key_base64);
+    attestation* myattestation = createAttestation(arena, DID_ATTESTATION_ID, DID_ATTESTATION_TYPE, myDocumentJwk);
 
 
-    //CREATE DID DOCUMENT
-    char* id = calloc(100, sizeof(char));
-    memcpy(id, "did:self:", 9);
+    //CREATE DID DOCUMENT, THE ID IS THE THUMBPRINT OF THE PROOF JWK
+    char* id = arenaAlloc(arena, LITERAL_LEN(DID_ID_PREFIX) + base64_estimate_encode_size(SHA256_DIGEST_LENGTH) + 1);
+    memcpy(id, DID_ID_PREFIX, LITERAL_LEN(DID_ID_PREFIX));
 
-    char* jwkHash = calloc(100, sizeof(char));
-    uint8_t* digest = hashSH256(jwkToStringLexicographically(myProofJwk));
-    bytes_to_base64url(digest, 32, jwkHash);
-    memcpy(id + 9, jwkHash, strlen(jwkHash));
+    jwkThumbprint(digest, myProofJwk);
+    bytes_to_base64url(digest, SHA256_DIGEST_LENGTH, id + LITERAL_LEN(DID_ID_PREFIX));
 
-    did_document* mydocument = createDidDocument(id, myattestation);
-    printf("%s\n", didDocumentToString(mydocument));
+    did_document* mydocument = createDidDocument(arena, id, myattestation);
 
 
     //CREATE PROOF PAYLOAD
@@ -567,33 +2287,44 @@ did* createDeviceDid(void)
     if (now == -1)
         puts("The time() function failed");
         
-    char* iat_str = calloc(10, sizeof(char));
-    sprintf(iat_str, "%ld", now);
+    char* iat_str = arenaAlloc(arena, DID_TIMESTAMP_MAX_LEN + 1);
+    sprintf(iat_str, "%ld", (long)now);
 
     struct tm* tm = localtime(&now);
     tm->tm_year = tm->tm_year + 1; // EXPIRE IN 1 YEAR
     time_t next = mktime(tm); // EXP
-    char* exp_str = calloc(10, sizeof(char));
-    sprintf(exp_str, "%ld", next);
+    char* exp_str = arenaAlloc(arena, DID_TIMESTAMP_MAX_LEN + 1);
+    sprintf(exp_str, "%ld", (long)next);
 
-    char* s256 = calloc(100, sizeof(char));
-    digest = hashSH256(didDocumentToStringNoSignature(mydocument));
-    bytes_to_base64url(digest, 32, s256);
+    char* s256 = arenaAlloc(arena, base64_estimate_encode_size(SHA256_DIGEST_LENGTH) + 1);
+    didDocumentDigest(digest, mydocument);
+    bytes_to_base64url(digest, SHA256_DIGEST_LENGTH, s256);
 
-    free(digest);
-
-    did_proof_payload* myDidProofPayload = createDidProofPayload(iat_str, exp_str, s256);
-    printf("%s\n", didProofPayloadToString(myDidProofPayload));
+    did_proof_payload* myDidProofPayload = createDidProofPayload(arena, iat_str, exp_str, s256);
 
     
     //CREATE PROOF
-    did_proof* myproof = createDidProof(myDidProofHeader, myDidProofPayload);
-    printf("%s\n", didProofToString(myproof));
+    did_proof* myproof = createDidProof(arena, myDidProofHeader, myDidProofPayload, newProofKeyPair);
 
 
     //CREATE DID COMPLETE
-    deviceDid = createDid(mydocument, myproof);
-    printf("%s\n", didToString(deviceDid));
+    did* newDid = createDid(arena, mydocument, myproof);
+
+    //PUBLISH THE NEW GENERATION AND TEAR DOWN THE RETIRED ONE
+    did* retiredDid = deviceDid;
+
+    deviceDid = newDid;
+    proof_key_pair = newProofKeyPair;
+    document_key_pair = newDocumentKeyPair;
+    next_arena = current_arena;
+    current_arena = arena;
+    epoch_next = DATA_EPOCH_LEAVES; //THE NEXT EPOCH IS SIGNED WITH THE NEW DOCUMENT KEY
+
+    //SERIALIZE ONCE FOR ALL FOLLOWING REQUESTS
+    cacheDidResponses(deviceDid);
+
+    deleteDid(retiredDid);
+    printf("DID arena: %u of %u bytes used\n", (unsigned)current_arena->used, (unsigned)sizeof(current_arena->buf));
 
     return deviceDid;
 }
@@ -609,19 +2340,23 @@ did* createDeviceDid(void)
 */
 static ssize_t getDid(coap_pkt_t *pkt, uint8_t *buf, size_t len, coap_request_ctx_t *context)
 {
-    (void)context;
+    if (!didLock(deviceDid == NULL)) {
+        return deferToWorker(pkt, buf, len, context);
+    }
     if (deviceDid == NULL) {
         createDeviceDid();
     }
     // char* result = calloc(IPV6_ADDR_MAX_STR_LEN, sizeof(char));
     // ipv6_addr_to_str(result, context->remote->addr, IPV6_ADDR_MAX_STR_LEN);
     // printf("Target: %s\n", result);
-    
 
-    char* response = didToStringAsBase64(deviceDid);
-    
-    return coap_reply_simple(pkt, COAP_CODE_205, buf, len+1024, //INCREASE BUFFER SIZE TO SEND BIGGER RESPONSE
-            COAP_FORMAT_TEXT, response, strlen(response));
+    ssize_t res = replyNegotiated(pkt, buf, len, DID_ETAG_DID,
+                                   did_response, did_response_len,
+                                   did_cbor_response, did_cbor_response_len,
+                                   did_cose_response, did_cose_response_len);
+    mutex_unlock(&did_lock);
+
+    return res;
 }
 
 // /* -- COAP REQUEST --
@@ -634,15 +2369,20 @@ static ssize_t getDid(coap_pkt_t *pkt, uint8_t *buf, size_t len, coap_request_ct
 */
 static ssize_t getDidDocument(coap_pkt_t *pkt, uint8_t *buf, size_t len, coap_request_ctx_t *context)
 {
-    (void)context;
+    if (!didLock(deviceDid == NULL)) {
+        return deferToWorker(pkt, buf, len, context);
+    }
     if (deviceDid == NULL) {
         createDeviceDid();
     }
 
-    char* response = didDocumentToString(deviceDid->document);
-    
-    return coap_reply_simple(pkt, COAP_CODE_205, buf, len+1024, //INCREASE BUFFER SIZE TO SEND BIGGER RESPONSE
-            COAP_FORMAT_TEXT, response, strlen(response));
+    ssize_t res = replyNegotiated(pkt, buf, len, DID_ETAG_DOCUMENT,
+                                   did_document_response, did_document_response_len,
+                                   did_document_cbor_response, did_document_cbor_response_len,
+                                   NULL, 0);
+    mutex_unlock(&did_lock);
+
+    return res;
 }
 
 // /* -- COAP REQUEST --
@@ -655,15 +2395,20 @@ static ssize_t getDidDocument(coap_pkt_t *pkt, uint8_t *buf, size_t len, coap_re
 */
 static ssize_t getDidProof(coap_pkt_t *pkt, uint8_t *buf, size_t len, coap_request_ctx_t *context)
 {
-    (void)context;
+    if (!didLock(deviceDid == NULL)) {
+        return deferToWorker(pkt, buf, len, context);
+    }
     if (deviceDid == NULL) {
         createDeviceDid();
     }
 
-    char* response = didProofToString(deviceDid->proof);
-    
-    return coap_reply_simple(pkt, COAP_CODE_205, buf, len+1024, //INCREASE BUFFER SIZE TO SEND BIGGER RESPONSE
-            COAP_FORMAT_TEXT, response, strlen(response));
+    ssize_t res = replyNegotiated(pkt, buf, len, DID_ETAG_PROOF,
+                                   did_proof_response, did_proof_response_len,
+                                   did_proof_cbor_response, did_proof_cbor_response_len,
+                                   NULL, 0);
+    mutex_unlock(&did_lock);
+
+    return res;
 }
 
 
@@ -677,13 +2422,47 @@ static ssize_t getDidProof(coap_pkt_t *pkt, uint8_t *buf, size_t len, coap_reque
 */
 static ssize_t updateDid(coap_pkt_t *pkt, uint8_t *buf, size_t len, coap_request_ctx_t *context)
 {
-    (void)context;
+    if (!didLock(true)) {
+        return deferToWorker(pkt, buf, len, context);
+    }
     createDeviceDid();
-    
-    return coap_reply_simple(pkt, COAP_CODE_205, buf, len+1024, //INCREASE BUFFER SIZE TO SEND BIGGER RESPONSE
+    mutex_unlock(&did_lock);
+
+    return coap_reply_simple(pkt, COAP_CODE_205, buf, len,
             COAP_FORMAT_TEXT, "DID Updated", 11);
 }
 
+// /* -- COAP REQUEST --
+// REQUEST: coap-client -m get coap://[fe80::7cde:caff:fe7f:ca57%tap0]/riot/stats
+// RESPONSE: {"signatures":12,"selfChecks":1,"selfCheckFailures":0,"didArena":604,"multicastDropped":0,"heap":0,"heapMax":1296}
+// */
+/** @brief  Get counters of the signing engine and the memory in use
+* heap and heapMax (current and highest bytes allocated) are only there with the malloc_monitor module.
+* @param COAP-PARAMETERS
+* @returns signatures made, signatures verified after signing, failed self-checks,
+*          bytes used in the arena of the served DID and multicast replies that
+*          were dropped as JSON
+*/
+static ssize_t getStats(coap_pkt_t *pkt, uint8_t *buf, size_t len, coap_request_ctx_t *context)
+{
+    (void)context;
+    char stats[192];
+    int stats_len = snprintf(stats, sizeof(stats), "{\"signatures\":%lu,\"selfChecks\":%lu,\"selfCheckFailures\":%lu,\"didArena\":%u"
+                             ",\"multicastDropped\":%lu",
+                             (unsigned long)signStats.signatures, (unsigned long)signStats.self_checks,
+                             (unsigned long)signStats.failed, (unsigned)current_arena->used,
+                             (unsigned long)coapServerDroppedReplies());
+#if IS_USED(MODULE_MALLOC_MONITOR)
+    stats_len += snprintf(stats + stats_len, sizeof(stats) - stats_len, ",\"heap\":%u,\"heapMax\":%u",
+                          (unsigned)malloc_monitor_get_usage_current(),
+                          (unsigned)malloc_monitor_get_usage_high_watermark());
+#endif
+    stats[stats_len++] = '}';
+
+    return coap_reply_simple(pkt, COAP_CODE_205, buf, len,
+            COAP_FORMAT_JSON, stats, stats_len);
+}
+
 /* must be sorted by path (ASCII order) */
 const coap_resource_t coap_resources[] = {
     COAP_WELL_KNOWN_CORE_DEFAULT_HANDLER,
@@ -692,6 +2471,7 @@ const coap_resource_t coap_resources[] = {
     { "/riot/did/document", COAP_GET, getDidDocument, NULL }, //MINE
     { "/riot/did/proof", COAP_GET, getDidProof, NULL }, //MINE
     { "/riot/data", COAP_GET, sendDataVerifiableWithDid, NULL }, //MINE
+    { "/riot/stats", COAP_GET, getStats, NULL }, //MINE
     { "/riot/did", COAP_PUT, updateDid, NULL }, //MINE
 };
 
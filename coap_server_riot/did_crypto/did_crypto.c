@@ -0,0 +1,288 @@
+/**
+ * @file
+ * @brief       Ed25519 backends of did_crypto: c25519, monocypher, tweetnacl, hacl
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "did_crypto.h"
+#include "random.h"
+
+#if IS_USED(MODULE_C25519)
+#include "edsign.h"
+#include "ed25519.h"
+#include "fprime.h"
+#include "sha512.h"
+#elif IS_USED(MODULE_MONOCYPHER)
+#include "monocypher.h"
+#include "monocypher-ed25519.h"
+#elif IS_USED(MODULE_TWEETNACL)
+#include "mutex.h"
+#include "tweetnacl.h"
+#elif IS_USED(MODULE_HACL)
+#include "Hacl_Ed25519.h"
+#else
+#error "did_crypto needs one of the c25519, monocypher, tweetnacl or hacl packages"
+#endif
+
+#if IS_USED(MODULE_C25519)
+// C25519 ---------------------------------------------------------
+// edsign_sign expands the seed with SHA-512 on every signature. The signing
+// context keeps the expanded key and signWithContext makes the same signature
+// from the c25519 primitives.
+
+/* Order of the Ed25519 base point (as in c25519 edsign.c) */
+static const uint8_t ed25519_order[FPRIME_SIZE] = {
+    0xed, 0xd3, 0xf5, 0x5c, 0x1a, 0x63, 0x12, 0x58,
+    0xd6, 0x9c, 0xf7, 0xa2, 0xde, 0xf9, 0xde, 0x14,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10
+};
+
+const char* didCryptoBackend(void){
+    return "c25519";
+}
+
+void didCryptoSignInit(did_sign_context* ctx, const uint8_t* secret_key, const uint8_t* public_key){
+    struct sha512_state sha;
+    uint8_t expanded[SHA512_HASH_SIZE];
+
+    sha512_init(&sha);
+    sha512_final(&sha, secret_key, DID_CRYPTO_SECRET_KEY_SIZE);
+    sha512_get(&sha, expanded, 0, SHA512_HASH_SIZE);
+    ed25519_prepare(expanded);
+
+    fprime_from_bytes(ctx->scalar, expanded, FPRIME_SIZE, ed25519_order);
+    memcpy(ctx->prefix, expanded + FPRIME_SIZE, sizeof(ctx->prefix));
+    memcpy(ctx->public_key, public_key, sizeof(ctx->public_key));
+
+    memset(expanded, 0, sizeof(expanded));
+}
+
+void didCryptoGenerate(did_sign_context* ctx, uint8_t* secret_key, uint8_t* public_key){
+    random_bytes(secret_key, DID_CRYPTO_SECRET_KEY_SIZE);
+    edsign_sec_to_pub(public_key, secret_key);
+    didCryptoSignInit(ctx, secret_key, public_key);
+}
+
+/** @brief  SHA-512 of block[0..prefix_len) || message, reduced mod the group order
+* @param[out] out FPRIME_SIZE bytes
+* @param[in] block SHA512_BLOCK_SIZE bytes starting with the prefix, used as scratch
+* @param[in] prefix_len length of the prefix, less than SHA512_BLOCK_SIZE
+* @param[in] message message
+* @param[in] len length of message
+*/
+static void hashWithPrefix(uint8_t* out, uint8_t* block, size_t prefix_len, const uint8_t* message, size_t len){
+    struct sha512_state sha;
+
+    sha512_init(&sha);
+    if (prefix_len + len < SHA512_BLOCK_SIZE) {
+        memcpy(block + prefix_len, message, len);
+        sha512_final(&sha, block, prefix_len + len);
+    }
+    else {
+        size_t i = SHA512_BLOCK_SIZE - prefix_len;
+
+        memcpy(block + prefix_len, message, i);
+        sha512_block(&sha, block);
+        for (; i + SHA512_BLOCK_SIZE <= len; i += SHA512_BLOCK_SIZE) {
+            sha512_block(&sha, message + i);
+        }
+        sha512_final(&sha, message + i, prefix_len + len);
+    }
+
+    sha512_get(&sha, block, 0, SHA512_HASH_SIZE);
+    fprime_from_bytes(out, block, SHA512_HASH_SIZE, ed25519_order);
+}
+
+void didCryptoSign(uint8_t* signature, const did_sign_context* ctx, const uint8_t* message, size_t len){
+    uint8_t block[SHA512_BLOCK_SIZE];
+    uint8_t k[FPRIME_SIZE];
+    uint8_t s[FPRIME_SIZE];
+    uint8_t x[F25519_SIZE];
+    uint8_t y[F25519_SIZE];
+    struct ed25519_pt r;
+
+    //NONCE k = H(prefix || M), R = kB
+    memcpy(block, ctx->prefix, sizeof(ctx->prefix));
+    hashWithPrefix(k, block, sizeof(ctx->prefix), message, len);
+    ed25519_smult(&r, &ed25519_base, k);
+    ed25519_unproject(x, y, &r);
+    ed25519_pack(signature, x, y);
+
+    //s = H(R || A || M) * a + k
+    memcpy(block, signature, FPRIME_SIZE);
+    memcpy(block + FPRIME_SIZE, ctx->public_key, sizeof(ctx->public_key));
+    hashWithPrefix(s, block, FPRIME_SIZE + sizeof(ctx->public_key), message, len);
+    fprime_mul(block, s, ctx->scalar, ed25519_order);
+    fprime_add(block, k, ed25519_order);
+    memcpy(signature + FPRIME_SIZE, block, FPRIME_SIZE);
+
+    memset(k, 0, sizeof(k));
+}
+
+bool didCryptoVerify(const uint8_t* signature, const uint8_t* public_key, const uint8_t* message, size_t len){
+    return edsign_verify(signature, public_key, message, len) != 0;
+}
+
+#elif IS_USED(MODULE_MONOCYPHER)
+// MONOCYPHER -----------------------------------------------------
+// Ed25519 of the optional monocypher-ed25519 (SHA-512 instead of BLAKE2b),
+// with secret keys as seed || public key.
+
+const char* didCryptoBackend(void){
+    return "monocypher";
+}
+
+void didCryptoSignInit(did_sign_context* ctx, const uint8_t* secret_key, const uint8_t* public_key){
+    memcpy(ctx->secret_key, secret_key, DID_CRYPTO_SECRET_KEY_SIZE);
+    memcpy(ctx->secret_key + DID_CRYPTO_SECRET_KEY_SIZE, public_key, DID_CRYPTO_PUBLIC_KEY_SIZE);
+    memcpy(ctx->public_key, public_key, sizeof(ctx->public_key));
+}
+
+void didCryptoGenerate(did_sign_context* ctx, uint8_t* secret_key, uint8_t* public_key){
+    uint8_t seed[DID_CRYPTO_SECRET_KEY_SIZE];
+
+    random_bytes(secret_key, DID_CRYPTO_SECRET_KEY_SIZE);
+    memcpy(seed, secret_key, sizeof(seed)); //WIPED BY crypto_ed25519_key_pair
+    crypto_ed25519_key_pair(ctx->secret_key, public_key, seed);
+    memcpy(ctx->public_key, public_key, sizeof(ctx->public_key));
+}
+
+void didCryptoSign(uint8_t* signature, const did_sign_context* ctx, const uint8_t* message, size_t len){
+    crypto_ed25519_sign(signature, ctx->secret_key, message, len);
+}
+
+bool didCryptoVerify(const uint8_t* signature, const uint8_t* public_key, const uint8_t* message, size_t len){
+    return crypto_ed25519_check(signature, public_key, message, len) == 0;
+}
+
+#elif IS_USED(MODULE_TWEETNACL)
+// TWEETNACL ------------------------------------------------------
+// crypto_sign and crypto_sign_open work on signature || message, so both go
+// through one buffer of CONFIG_DID_CRYPTO_MESSAGE_MAX bytes plus a signature.
+// Key pairs only come from crypto_sign_keypair, TweetNaCl has no public key
+// of a given seed.
+
+static uint8_t signed_message[CONFIG_DID_CRYPTO_MESSAGE_MAX + DID_CRYPTO_SIGNATURE_SIZE];
+static uint8_t opened_message[CONFIG_DID_CRYPTO_MESSAGE_MAX + DID_CRYPTO_SIGNATURE_SIZE];
+static mutex_t signed_message_lock = MUTEX_INIT;
+
+const char* didCryptoBackend(void){
+    return "tweetnacl";
+}
+
+void didCryptoSignInit(did_sign_context* ctx, const uint8_t* secret_key, const uint8_t* public_key){
+    memcpy(ctx->secret_key, secret_key, DID_CRYPTO_SECRET_KEY_SIZE);
+    memcpy(ctx->secret_key + DID_CRYPTO_SECRET_KEY_SIZE, public_key, DID_CRYPTO_PUBLIC_KEY_SIZE);
+    memcpy(ctx->public_key, public_key, sizeof(ctx->public_key));
+}
+
+void didCryptoGenerate(did_sign_context* ctx, uint8_t* secret_key, uint8_t* public_key){
+    crypto_sign_keypair(public_key, ctx->secret_key);
+    memcpy(secret_key, ctx->secret_key, DID_CRYPTO_SECRET_KEY_SIZE);
+    memcpy(ctx->public_key, public_key, sizeof(ctx->public_key));
+}
+
+void didCryptoSign(uint8_t* signature, const did_sign_context* ctx, const uint8_t* message, size_t len){
+    unsigned long long signed_len;
+
+    if (len > CONFIG_DID_CRYPTO_MESSAGE_MAX) {
+        printf("Message of %u bytes too long to sign, increase CONFIG_DID_CRYPTO_MESSAGE_MAX\n", (unsigned)len);
+        memset(signature, 0, DID_CRYPTO_SIGNATURE_SIZE);
+        return;
+    }
+
+    mutex_lock(&signed_message_lock);
+    crypto_sign(signed_message, &signed_len, message, len, ctx->secret_key);
+    memcpy(signature, signed_message, DID_CRYPTO_SIGNATURE_SIZE);
+    mutex_unlock(&signed_message_lock);
+}
+
+bool didCryptoVerify(const uint8_t* signature, const uint8_t* public_key, const uint8_t* message, size_t len){
+    unsigned long long opened_len;
+
+    if (len > CONFIG_DID_CRYPTO_MESSAGE_MAX) {
+        return false;
+    }
+
+    mutex_lock(&signed_message_lock);
+    memcpy(signed_message, signature, DID_CRYPTO_SIGNATURE_SIZE);
+    memcpy(signed_message + DID_CRYPTO_SIGNATURE_SIZE, message, len);
+    bool valid = crypto_sign_open(opened_message, &opened_len, signed_message,
+                                  len + DID_CRYPTO_SIGNATURE_SIZE, public_key) == 0;
+    mutex_unlock(&signed_message_lock);
+
+    return valid;
+}
+
+#elif IS_USED(MODULE_HACL)
+// HACL* ----------------------------------------------------------
+// Verified Ed25519 of the HACL* snapshot, which signs from the seed.
+
+const char* didCryptoBackend(void){
+    return "hacl";
+}
+
+void didCryptoSignInit(did_sign_context* ctx, const uint8_t* secret_key, const uint8_t* public_key){
+    memcpy(ctx->secret_key, secret_key, DID_CRYPTO_SECRET_KEY_SIZE);
+    memcpy(ctx->secret_key + DID_CRYPTO_SECRET_KEY_SIZE, public_key, DID_CRYPTO_PUBLIC_KEY_SIZE);
+    memcpy(ctx->public_key, public_key, sizeof(ctx->public_key));
+}
+
+void didCryptoGenerate(did_sign_context* ctx, uint8_t* secret_key, uint8_t* public_key){
+    random_bytes(secret_key, DID_CRYPTO_SECRET_KEY_SIZE);
+    Hacl_Ed25519_secret_to_public(public_key, secret_key);
+    didCryptoSignInit(ctx, secret_key, public_key);
+}
+
+void didCryptoSign(uint8_t* signature, const did_sign_context* ctx, const uint8_t* message, size_t len){
+    Hacl_Ed25519_sign(signature, (uint8_t*)ctx->secret_key, (uint8_t*)message, len);
+}
+
+bool didCryptoVerify(const uint8_t* signature, const uint8_t* public_key, const uint8_t* message, size_t len){
+    return Hacl_Ed25519_verify((uint8_t*)public_key, (uint8_t*)message, len, (uint8_t*)signature);
+}
+#endif
+//----------------------------------------------------------------
+
+void didCryptoWipe(did_sign_context* ctx){
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+int didCryptoSelfTest(void){
+    //RFC 8032 7.1 TEST 2
+    static const uint8_t secret_key[DID_CRYPTO_SECRET_KEY_SIZE] = {
+        0x4c, 0xcd, 0x08, 0x9b, 0x28, 0xff, 0x96, 0xda, 0x9d, 0xb6, 0xc3, 0x46, 0xec, 0x11, 0x4e, 0x0f,
+        0x5b, 0x8a, 0x31, 0x9f, 0x35, 0xab, 0xa6, 0x24, 0xda, 0x8c, 0xf6, 0xed, 0x4f, 0xb8, 0xa6, 0xfb
+    };
+    static const uint8_t public_key[DID_CRYPTO_PUBLIC_KEY_SIZE] = {
+        0x3d, 0x40, 0x17, 0xc3, 0xe8, 0x43, 0x89, 0x5a, 0x92, 0xb7, 0x0a, 0xa7, 0x4d, 0x1b, 0x7e, 0xbc,
+        0x9c, 0x98, 0x2c, 0xcf, 0x2e, 0xc4, 0x96, 0x8c, 0xc0, 0xcd, 0x55, 0xf1, 0x2a, 0xf4, 0x66, 0x0c
+    };
+    static const uint8_t message[] = { 0x72 };
+    static const uint8_t expected[DID_CRYPTO_SIGNATURE_SIZE] = {
+        0x92, 0xa0, 0x09, 0xa9, 0xf0, 0xd4, 0xca, 0xb8, 0x72, 0x0e, 0x82, 0x0b, 0x5f, 0x64, 0x25, 0x40,
+        0xa2, 0xb2, 0x7b, 0x54, 0x16, 0x50, 0x3f, 0x8f, 0xb3, 0x76, 0x22, 0x23, 0xeb, 0xdb, 0x69, 0xda,
+        0x08, 0x5a, 0xc1, 0xe4, 0x3e, 0x15, 0x99, 0x6e, 0x45, 0x8f, 0x36, 0x13, 0xd0, 0xf1, 0x1d, 0x8c,
+        0x38, 0x7b, 0x2e, 0xae, 0xb4, 0x30, 0x2a, 0xee, 0xb0, 0x0d, 0x29, 0x16, 0x12, 0xbb, 0x0c, 0x00
+    };
+    uint8_t signature[DID_CRYPTO_SIGNATURE_SIZE];
+    did_sign_context ctx;
+
+    didCryptoSignInit(&ctx, secret_key, public_key);
+    didCryptoSign(signature, &ctx, message, sizeof(message));
+    didCryptoWipe(&ctx);
+
+    if (memcmp(signature, expected, sizeof(expected)) != 0 ||
+        !didCryptoVerify(signature, public_key, message, sizeof(message))) {
+        return -1;
+    }
+
+    signature[0] ^= 0x01;
+    if (didCryptoVerify(signature, public_key, message, sizeof(message))) {
+        return -1;
+    }
+    return 0;
+}
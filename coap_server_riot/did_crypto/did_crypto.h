@@ -0,0 +1,87 @@
+/**
+ * @file
+ * @brief       Ed25519 signing and verification of the did:self device
+ *
+ * One interface over the Ed25519 implementations RIOT packages. The backend
+ * is chosen at build time with DID_CRYPTO (c25519, monocypher, tweetnacl or
+ * hacl), the handler code does not change.
+ */
+
+#ifndef DID_CRYPTO_H
+#define DID_CRYPTO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "kernel_defines.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DID_CRYPTO_SECRET_KEY_SIZE  (32U)   //SEED OF RFC 8032
+#define DID_CRYPTO_PUBLIC_KEY_SIZE  (32U)
+#define DID_CRYPTO_SIGNATURE_SIZE   (64U)
+
+/* Longest message the tweetnacl backend signs or verifies, its API works on
+ * signature || message in one buffer */
+#ifndef CONFIG_DID_CRYPTO_MESSAGE_MAX
+#define CONFIG_DID_CRYPTO_MESSAGE_MAX   (512U)
+#endif
+
+/** @brief  Key of a key pair as the backend signs with it */
+typedef struct {
+#if IS_USED(MODULE_C25519)
+    /* expanded key, edsign_sign would derive it with SHA-512 on every signature */
+    uint8_t scalar[32];     //CLAMPED SECRET SCALAR MOD THE GROUP ORDER
+    uint8_t prefix[32];     //NONCE PREFIX, SECOND HALF OF SHA-512(SEED)
+#else
+    uint8_t secret_key[DID_CRYPTO_SECRET_KEY_SIZE + DID_CRYPTO_PUBLIC_KEY_SIZE]; //SEED || PUBLIC KEY
+#endif
+    uint8_t public_key[DID_CRYPTO_PUBLIC_KEY_SIZE];
+} did_sign_context;
+
+/** @brief  Name of the backend, e.g. "c25519" */
+const char* didCryptoBackend(void);
+
+/** @brief  Generate a random key pair
+* @param[out] ctx signing context of the new key pair
+* @param[out] secret_key DID_CRYPTO_SECRET_KEY_SIZE bytes
+* @param[out] public_key DID_CRYPTO_PUBLIC_KEY_SIZE bytes
+*/
+void didCryptoGenerate(did_sign_context* ctx, uint8_t* secret_key, uint8_t* public_key);
+
+/** @brief  Signing context of an existing key pair
+* @param[out] ctx signing context
+* @param[in] secret_key DID_CRYPTO_SECRET_KEY_SIZE bytes
+* @param[in] public_key DID_CRYPTO_PUBLIC_KEY_SIZE bytes belonging to secret_key
+*/
+void didCryptoSignInit(did_sign_context* ctx, const uint8_t* secret_key, const uint8_t* public_key);
+
+/** @brief  Sign a message
+* @param[out] signature DID_CRYPTO_SIGNATURE_SIZE bytes
+* @param[in] ctx signing context
+* @param[in] message to sign
+* @param[in] len length of message
+*/
+void didCryptoSign(uint8_t* signature, const did_sign_context* ctx, const uint8_t* message, size_t len);
+
+/** @brief  Verify a signature
+* @returns true if signature is a valid signature of message by public_key
+*/
+bool didCryptoVerify(const uint8_t* signature, const uint8_t* public_key, const uint8_t* message, size_t len);
+
+/** @brief  Wipe a signing context */
+void didCryptoWipe(did_sign_context* ctx);
+
+/** @brief  Known answer test of the backend (RFC 8032 test vector 2)
+* @returns 0 if the backend signs and verifies as RFC 8032 expects, -1 otherwise
+*/
+int didCryptoSelfTest(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DID_CRYPTO_H */
@@ -18,15 +18,233 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 
+#include "mutex.h"
+#include "net/ipv6/addr.h"
 #include "net/nanocoap_sock.h"
+#include "net/netif.h"
+#include "net/sock/udp.h"
+#include "random.h"
 #include "xtimer.h"
 
+/* Request and reply share this buffer. Replies larger than one block are
+ * sent blockwise, so it only needs to hold one block plus headers. */
+#ifndef COAP_INBUF_SIZE
 #define COAP_INBUF_SIZE (2048U)
+#endif
+
+/* Replies to multicast requests are delayed by a random time up to this
+ * leisure, so that the devices of a link do not all answer at once
+ * (RFC 7252 8.2). The gateway collects them for a longer window. */
+#ifndef CONFIG_DID_MULTICAST_LEISURE_MS
+#define CONFIG_DID_MULTICAST_LEISURE_MS (1000U)
+#endif
+
+/* Multicast replies waiting for their leisure to pass, and the size of each.
+ * A reply is the first block of a resource, one that does not fit or finds
+ * no free slot is not sent. */
+#ifndef CONFIG_DID_MULTICAST_REPLIES
+#define CONFIG_DID_MULTICAST_REPLIES    (4U)
+#endif
+#ifndef CONFIG_DID_MULTICAST_REPLY_SIZE
+#define CONFIG_DID_MULTICAST_REPLY_SIZE (256U)
+#endif
+
+/* Boot self-test of the DID signing engine, in coap_handler.c */
+extern int didSignSelfTest(void);
+/* Crypto worker and its separate responses, in coap_handler.c */
+extern void didCryptoWorkerStart(void);
+extern void didSeparateAck(uint16_t id, bool reset);
 
 #define MAIN_QUEUE_SIZE     (8)
 static msg_t _main_msg_queue[MAIN_QUEUE_SIZE];
 
+/* The server loop and the crypto worker both send on this socket */
+static sock_udp_t _sock;
+static mutex_t _sock_lock = MUTEX_INIT;
+
+/** @brief  Send a CoAP message on the server socket
+* @param[in] data message
+* @param[in] len length of message
+* @param[in] remote destination
+* @returns bytes sent or negative errno
+*/
+ssize_t coapServerSend(const void* data, size_t len, const sock_udp_ep_t* remote)
+{
+    mutex_lock(&_sock_lock);
+    ssize_t res = sock_udp_send(&_sock, data, len, remote);
+    mutex_unlock(&_sock_lock);
+
+    return res;
+}
+
+typedef struct {
+    bool pending;
+    uint32_t due;               //xtimer_now_usec() AT WHICH IT IS SENT
+    sock_udp_ep_t remote;
+    uint8_t reply[CONFIG_DID_MULTICAST_REPLY_SIZE];
+    size_t len;
+} delayed_reply;
+
+static delayed_reply _delayed_replies[CONFIG_DID_MULTICAST_REPLIES];
+static uint32_t _dropped_replies = 0;
+static bool _request_multicast = false;
+
+/** @brief  Check if the request being handled by the server loop was sent to a multicast group
+* Handlers do not defer such requests to the crypto worker, which would answer
+* them without the leisure.
+*/
+bool coapServerRequestIsMulticast(void)
+{
+    return _request_multicast;
+}
+
+/** @brief  Multicast replies that were not sent, too large or without a free slot */
+uint32_t coapServerDroppedReplies(void)
+{
+    return _dropped_replies;
+}
+
+/** @brief  Copy a reply to a multicast request to be sent after a random delay within the leisure
+* @param[in] reply reply
+* @param[in] len length of reply
+* @param[in] remote destination
+*/
+static void _delay_reply(const uint8_t *reply, size_t len, const sock_udp_ep_t *remote)
+{
+    if (len > CONFIG_DID_MULTICAST_REPLY_SIZE) {
+        _dropped_replies++;
+        return;
+    }
+    for (unsigned i = 0; i < CONFIG_DID_MULTICAST_REPLIES; i++) {
+        delayed_reply *delayed = &_delayed_replies[i];
+        if (!delayed->pending) {
+            delayed->pending = true;
+            delayed->due = xtimer_now_usec() + random_uint32_range(0, CONFIG_DID_MULTICAST_LEISURE_MS * US_PER_MS);
+            delayed->remote = *remote;
+            memcpy(delayed->reply, reply, len);
+            delayed->len = len;
+            return;
+        }
+    }
+    _dropped_replies++;
+}
+
+/** @brief  Send the delayed replies that are due
+* @returns microseconds until the next one is due, SOCK_NO_TIMEOUT if none is left
+*/
+static uint32_t _send_due_replies(void)
+{
+    uint32_t timeout = SOCK_NO_TIMEOUT;
+    uint32_t now = xtimer_now_usec();
+
+    for (unsigned i = 0; i < CONFIG_DID_MULTICAST_REPLIES; i++) {
+        delayed_reply *delayed = &_delayed_replies[i];
+        if (!delayed->pending) {
+            continue;
+        }
+        int32_t left = (int32_t)(delayed->due - now);
+        if (left <= 0) {
+            coapServerSend(delayed->reply, delayed->len, &delayed->remote);
+            delayed->pending = false;
+        }
+        else if ((uint32_t)left < timeout) {
+            timeout = left;
+        }
+    }
+    return timeout;
+}
+
+/** @brief  Join the all-CoAP-nodes group (ff02::fd) on every interface
+* The gateway discovers devices and reads their board with one multicast
+* request instead of one per device.
+*/
+static void _join_coap_group(void)
+{
+    ipv6_addr_t group;
+    ipv6_addr_from_str(&group, "ff02::fd");
+
+    netif_t *netif = NULL;
+    while ((netif = netif_iter(netif)) != NULL) {
+        if (netif_set_opt(netif, NETOPT_IPV6_GROUP, 0, &group, sizeof(group)) < 0) {
+            puts("Could not join ff02::fd");
+        }
+    }
+}
+
+/** @brief  CoAP server loop
+* Like nanocoap_server, but ACKs and RSTs of separate responses are handed to
+* the crypto worker and a handler may return 0 to send nothing.
+* Multicast requests are only answered when they are NON and succeed, after a
+* random delay within the leisure (RFC 7252 8.1, 8.2). The loop does not wait
+* for it: the reply is copied and sent when a receive times out at its time.
+* @param[in] local local endpoint to listen on
+* @param[in] buf request and reply buffer
+* @param[in] bufsize size of buf
+*/
+static int _coap_server(sock_udp_ep_t *local, uint8_t *buf, size_t bufsize)
+{
+    int res = sock_udp_create(&_sock, local, NULL, 0);
+    if (res != 0) {
+        return res;
+    }
+
+    while (1) {
+        sock_udp_ep_t remote;
+        sock_udp_aux_rx_t aux = { .flags = SOCK_AUX_GET_LOCAL };
+        coap_pkt_t pkt;
+
+        uint32_t timeout = _send_due_replies();
+        ssize_t len = sock_udp_recv_aux(&_sock, buf, bufsize, timeout, &remote, &aux);
+        if (len <= 0 || coap_parse(&pkt, buf, len) < 0) {
+            continue;
+        }
+
+        /* the flag is cleared when the local address was filled in */
+        bool multicast = !(aux.flags & SOCK_AUX_GET_LOCAL) &&
+                         ipv6_addr_is_multicast((ipv6_addr_t *)aux.local.addr.ipv6);
+
+        unsigned type = coap_get_type(&pkt);
+        if (multicast && type != COAP_TYPE_NON) {
+            continue;
+        }
+        if (type == COAP_TYPE_ACK || type == COAP_TYPE_RST) {
+            didSeparateAck(coap_get_id(&pkt), type == COAP_TYPE_RST);
+            continue;
+        }
+        if (coap_get_code_raw(&pkt) == COAP_CODE_EMPTY) {
+            /* CoAP ping */
+            if (type == COAP_TYPE_CON) {
+                len = coap_build_hdr((coap_hdr_t *)buf, COAP_TYPE_RST, NULL, 0, COAP_CODE_EMPTY, coap_get_id(&pkt));
+                coapServerSend(buf, len, &remote);
+            }
+            continue;
+        }
+
+        coap_request_ctx_t ctx = { .remote = &remote };
+        _request_multicast = multicast;
+        len = coap_handle_req(&pkt, buf, bufsize, &ctx);
+        _request_multicast = false;
+        if (len <= 0) {
+            continue;
+        }
+        if (multicast) {
+            /* the reply was written over the request, pkt.hdr points to it */
+            if (coap_get_code_class(&pkt) != COAP_CLASS_SUCCESS) {
+                continue;
+            }
+#if CONFIG_DID_MULTICAST_LEISURE_MS > 0
+            _delay_reply(buf, len, &remote);
+            continue;
+#endif
+        }
+        coapServerSend(buf, len, &remote);
+    }
+
+    return 0;
+}
+
 
 
 int main(void)
@@ -44,6 +262,15 @@ int main(void)
     netifs_print_ipv6("\", \"");
     puts("\"]}");
 
+    if (didSignSelfTest() != 0) {
+        puts("Ed25519 self-test failed");
+    }
+
+    /* keys are generated and data is signed there, not in the server loop */
+    didCryptoWorkerStart();
+
+    _join_coap_group();
+
     /* initialize nanocoap server instance */
     uint8_t buf[COAP_INBUF_SIZE];
     sock_udp_ep_t local = { .port=COAP_PORT, .family=AF_INET6 };
@@ -74,7 +301,7 @@ int main(void)
     // nanocoap_sock_request(sock, pkt, COAP_INBUF_SIZE);
 
 
-    nanocoap_server(&local, buf, sizeof(buf));
+    _coap_server(&local, buf, sizeof(buf));
 
     /* should be never reached */
     return 0;
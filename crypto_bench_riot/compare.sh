@@ -0,0 +1,75 @@
+#!/bin/bash
+# Build and run the did_crypto benchmark for every Ed25519 backend and print
+# sign/verify time, stack and ROM size side by side.
+#
+#   $ ./compare.sh                          # native, all backends
+#   $ BOARD=nrf52840dk ./compare.sh c25519 monocypher
+#
+# Results are also written as JSON lines to crypto_bench_$BOARD.jsonl.
+# Only c25519 has been run so far, monocypher, tweetnacl and hacl are untested.
+
+cd "$(dirname "$0")" || exit 1
+
+BOARD=${BOARD:-native}
+BACKENDS=${*:-c25519 monocypher tweetnacl hacl}
+OUT=crypto_bench_${BOARD}.jsonl
+: > "$OUT"
+
+# Modules the backend package builds, their objects are its ROM share
+pkgModules() {
+    case $1 in
+        monocypher) echo "monocypher monocypher_optional" ;;
+        *) echo "$1" ;;
+    esac
+}
+
+for backend in $BACKENDS; do
+    bindir=$PWD/bin/$BOARD-$backend
+    make BOARD="$BOARD" DID_CRYPTO="$backend" all > /dev/null || { echo "build with $backend failed"; continue; }
+
+    objects=$bindir/did_crypto/*.o
+    for module in $(pkgModules "$backend"); do
+        objects="$objects $bindir/$module/*.o"
+    done
+    # text + data of the backend, and of the whole firmware
+    rom=$(size -t $objects | awk 'END { print $1 + $2 }')
+    firmware=$(size "$bindir/did_crypto_bench.elf" | awk 'NR == 2 { print $1 + $2 }')
+    echo "{\"cryptoRom\":{\"backend\":\"$backend\",\"romBytes\":$rom,\"firmwareRomBytes\":$firmware}}" >> "$OUT"
+
+    if [ "$BOARD" = native ]; then
+        # native keeps running after main returns
+        log=$bindir/bench.log
+        "$bindir/did_crypto_bench.elf" > "$log" &
+        pid=$!
+        for _ in $(seq 600); do
+            grep -q -e cryptoBenchDone -e 'FAILED ASSERTION' "$log" && break
+            sleep 1
+        done
+        kill $pid
+        grep '^{' "$log" >> "$OUT"
+    else
+        make BOARD="$BOARD" DID_CRYPTO="$backend" flash-only > /dev/null || { echo "flashing $backend failed"; continue; }
+        timeout 600 make BOARD="$BOARD" DID_CRYPTO="$backend" term | sed -e '/cryptoBenchDone/q' -e '/FAILED ASSERTION/q' | grep -o '{.*}' >> "$OUT"
+    fi
+    # c25519 checks that the signing context signs like edsign_sign
+    grep -q "\"signMatchesEdsign\":false,\"backend\":\"$backend\"" "$OUT" && echo "$backend: signature differs from edsign_sign"
+done
+
+python3 - "$OUT" <<'EOF'
+import json, sys
+
+rom, ops = {}, {}
+for line in open(sys.argv[1]):
+    entry = json.loads(line)
+    if 'cryptoRom' in entry:
+        rom[entry['cryptoRom']['backend']] = entry['cryptoRom']
+    elif 'cryptoBench' in entry:
+        bench = entry['cryptoBench']
+        ops.setdefault(bench['backend'], []).append(bench)
+
+print('%-11s %-9s %6s %10s %12s %7s %9s' % ('backend', 'op', 'bytes', 'us', 'cycles', 'stack', 'rom'))
+for backend in rom:
+    for bench in ops.get(backend, []):
+        print('%-11s %-9s %6d %10d %12d %7d %9d' % (backend, bench['op'], bench['messageBytes'], bench['us'],
+                                                   bench['cycles'], bench['stackBytes'], rom[backend]['romBytes']))
+EOF
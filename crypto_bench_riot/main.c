@@ -0,0 +1,158 @@
+/**
+ * @file
+ * @brief       Benchmark of the did_crypto Ed25519 backend
+ *
+ * Times key generation, signing and verification of the messages the did:self
+ * device signs (a reading and the signing input of a DID proof) and measures
+ * the stack each operation needs. Build once per backend with DID_CRYPTO,
+ * compare.sh adds the ROM size and collects the results. With c25519 it also
+ * times edsign_sign, which expands the secret key on every signature, as the
+ * baseline of the expanded key of the signing context.
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "did_crypto.h"
+#include "random.h"
+#include "thread.h"
+#include "xtimer.h"
+
+#if IS_USED(MODULE_C25519)
+#include "edsign.h"
+#endif
+
+/* Operations timed per message size */
+#ifndef CONFIG_CRYPTO_BENCH_COUNT
+#define CONFIG_CRYPTO_BENCH_COUNT   (20U)
+#endif
+
+/* Stack of the thread one operation is measured in */
+#ifndef CONFIG_CRYPTO_BENCH_STACK_SIZE
+#define CONFIG_CRYPTO_BENCH_STACK_SIZE  (THREAD_STACKSIZE_DEFAULT + 4096)
+#endif
+
+/* Base64url reading and DID proof signing input of coap_handler.c */
+#define READING_LEN         (96U)
+#define SIGNING_INPUT_LEN   (412U)
+
+enum { OP_GENERATE, OP_SIGN, OP_VERIFY, OP_EDSIGN };
+
+static uint8_t message[SIGNING_INPUT_LEN];
+static uint8_t secret_key[DID_CRYPTO_SECRET_KEY_SIZE];
+static uint8_t public_key[DID_CRYPTO_PUBLIC_KEY_SIZE];
+static uint8_t signature[DID_CRYPTO_SIGNATURE_SIZE];
+static did_sign_context ctx;
+
+static char op_stack[CONFIG_CRYPTO_BENCH_STACK_SIZE];
+static unsigned op_kind;
+static size_t op_len;
+
+/** @brief  CPU cycle counter, 0 where there is none */
+static uint64_t benchCycles(void){
+#if defined(CPU_NATIVE) && (defined(__i386__) || defined(__x86_64__))
+    return __builtin_ia32_rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static void runOp(unsigned kind, size_t len){
+    switch (kind) {
+    case OP_GENERATE:
+        didCryptoGenerate(&ctx, secret_key, public_key);
+        break;
+    case OP_SIGN:
+        didCryptoSign(signature, &ctx, message, len);
+        break;
+    case OP_VERIFY:
+        if (!didCryptoVerify(signature, public_key, message, len)) {
+            puts("SIGNATURE DID NOT VERIFY");
+        }
+        break;
+#if IS_USED(MODULE_C25519)
+    case OP_EDSIGN:
+        edsign_sign(signature, public_key, secret_key, message, len);
+        break;
+#endif
+    }
+}
+
+static void* opThread(void* arg){
+    (void)arg;
+    runOp(op_kind, op_len);
+    return NULL;
+}
+
+/** @brief  Stack used by one operation
+* The operation runs in a thread of higher priority than main, which has
+* finished by the time thread_create returns.
+* @returns bytes of stack used, including the thread's own overhead
+*/
+static unsigned stackOf(unsigned kind, size_t len){
+    op_kind = kind;
+    op_len = len;
+    thread_create(op_stack, sizeof(op_stack), THREAD_PRIORITY_MAIN - 1,
+                  THREAD_CREATE_STACKTEST, opThread, NULL, "crypto_bench");
+    return sizeof(op_stack) - thread_measure_stack_free(op_stack);
+}
+
+/** @brief  Print time, cycles (on native) and stack of one operation as JSON */
+static void bench(const char* name, unsigned kind, size_t len){
+    uint32_t start = xtimer_now_usec();
+    uint64_t cycles = benchCycles();
+    for (unsigned n = 0; n < CONFIG_CRYPTO_BENCH_COUNT; n++) {
+        runOp(kind, len);
+    }
+    cycles = (benchCycles() - cycles) / CONFIG_CRYPTO_BENCH_COUNT;
+    uint32_t us = (xtimer_now_usec() - start) / CONFIG_CRYPTO_BENCH_COUNT;
+
+    printf("{\"cryptoBench\":{\"backend\":\"%s\",\"op\":\"%s\",\"messageBytes\":%u,\"count\":%u,"
+           "\"us\":%lu,\"cycles\":%lu,\"stackBytes\":%u}}\n",
+           didCryptoBackend(), name, (unsigned)len, CONFIG_CRYPTO_BENCH_COUNT,
+           (unsigned long)us, (unsigned long)cycles, stackOf(kind, len));
+}
+
+#if IS_USED(MODULE_C25519)
+/** @brief  Check that the signing context signs like edsign_sign
+* @returns true if both signatures of message are the same
+*/
+static bool signMatchesEdsign(size_t len){
+    uint8_t expected[DID_CRYPTO_SIGNATURE_SIZE];
+
+    edsign_sign(expected, public_key, secret_key, message, len);
+    didCryptoSign(signature, &ctx, message, len);
+    return memcmp(expected, signature, sizeof(expected)) == 0;
+}
+#endif
+
+int main(void)
+{
+    static const size_t sizes[] = { READING_LEN, SIGNING_INPUT_LEN };
+
+    printf("{\"cryptoBackend\":\"%s\",\"board\":\"%s\",\"selfTest\":%s}\n", didCryptoBackend(), RIOT_BOARD,
+           didCryptoSelfTest() == 0 ? "true" : "false");
+
+    random_bytes(message, sizeof(message));
+    bench("generate", OP_GENERATE, 0);
+
+    for (unsigned i = 0; i < ARRAY_SIZE(sizes); i++) {
+#if IS_USED(MODULE_C25519)
+        bool match = signMatchesEdsign(sizes[i]);
+        printf("{\"signMatchesEdsign\":%s,\"backend\":\"%s\",\"messageBytes\":%u}\n",
+               match ? "true" : "false", didCryptoBackend(), (unsigned)sizes[i]);
+        assert(match);
+        bench("edsign", OP_EDSIGN, sizes[i]);
+#endif
+        bench("sign", OP_SIGN, sizes[i]);
+        bench("verify", OP_VERIFY, sizes[i]);
+    }
+
+    didCryptoWipe(&ctx);
+    memset(secret_key, 0, sizeof(secret_key));
+    puts("{\"cryptoBenchDone\":true}");
+
+    return 0;
+}
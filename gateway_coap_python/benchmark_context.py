@@ -0,0 +1,128 @@
+"""Gateway throughput with a client context per request versus one shared context.
+
+Starts simulated devices (aiocoap servers on ::1 answering /riot/board), lets
+the gateway resource /riot/board fan out to all of them and reports requests/s
+and the open file descriptors for both ways of creating the client context.
+The response cache is disabled so that every request reaches the devices.
+
+    $ python3 benchmark_context.py -d 8 -n 200
+"""
+import argparse
+import asyncio
+import contextlib
+import io
+import json
+import os
+import time
+
+import aiocoap
+from aiocoap import Context, resource
+
+import gateway_coap_server_client as gateway
+
+
+BASE_PORT = 56830
+
+
+class SimulatedBoard(resource.Resource):
+    def __init__(self, name):
+        super().__init__()
+        self.payload = json.dumps({'board': name}).encode('ascii')
+
+    async def render_get(self, request):
+        return aiocoap.Message(payload=self.payload)
+
+
+async def startDevices(count):
+    servers = []
+    for i in range(count):
+        root = resource.Site()
+        root.add_resource(['riot', 'board'], SimulatedBoard('sim%d' % i))
+        servers.append(await Context.create_server_context(root, bind=('::1', BASE_PORT + i)))
+    return servers
+
+
+def openFiles():
+    return len(os.listdir('/proc/self/fd'))
+
+
+async def perRequestContext():
+    """What the resources did before: a fresh client context per request, never shut down"""
+    gateway.clientContext = await Context.create_client_context()
+
+
+async def sharedContext():
+    pass
+
+
+MODES = {
+    'per-request': perRequestContext,
+    'shared': sharedContext,
+}
+
+
+async def measure(prepare, count, concurrency):
+    board = gateway.RiotBoard()
+    filesBefore = openFiles()
+    errors = 0
+
+    async def one():
+        nonlocal errors
+        await prepare()
+        response = await board.render_get(aiocoap.Message(code=aiocoap.GET))
+        if b'"status"' in response.payload:
+            errors += 1
+
+    start = time.perf_counter()
+    with contextlib.redirect_stdout(io.StringIO()):
+        for offset in range(0, count, concurrency):
+            await asyncio.gather(*(one() for _ in range(min(concurrency, count - offset))))
+    elapsed = time.perf_counter() - start
+
+    return {
+        'requests_per_s': count / elapsed,
+        'device_requests_per_s': count * len(gateway.directory.endpoints('/riot/board')) / elapsed,
+        'failed': errors,
+        'open_files': openFiles() - filesBefore,
+    }
+
+
+async def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('-d', '--devices', type=int, default=4, help="simulated devices")
+    parser.add_argument('-n', '--count', type=int, default=100, help="gateway requests per mode")
+    parser.add_argument('-c', '--concurrency', type=int, default=4, help="gateway requests in flight")
+    parser.add_argument('--json', action='store_true', help="print machine-readable results")
+    args = parser.parse_args()
+
+    gateway.CACHE_ENABLED = False
+    servers = await startDevices(args.devices)
+    for i in range(args.devices):
+        device = '[::1]:%d' % (BASE_PORT + i)
+        gateway.directory.register(device, device, gateway.RD_DEFAULT_LIFETIME, {'/riot/board': []})
+
+    shared = await Context.create_client_context()
+    results = {}
+
+    # The shared context goes first so that leaked per-request contexts do not slow it down
+    for name in ('shared', 'per-request'):
+        gateway.clientContext = shared
+        results[name] = await measure(MODES[name], args.count, args.concurrency)
+
+    await shared.shutdown()
+    for server in servers:
+        await server.shutdown()
+
+    if args.json:
+        print(json.dumps(results, indent=2))
+        return
+
+    print('%-12s %12s %14s %8s %12s' % ('context', 'requests/s', 'device req/s', 'failed', 'open files'))
+    for name, result in results.items():
+        print('%-12s %12.1f %14.1f %8d %12d' % (
+            name, result['requests_per_s'], result['device_requests_per_s'],
+            result['failed'], result['open_files']))
+
+
+if __name__ == "__main__":
+    asyncio.run(main())
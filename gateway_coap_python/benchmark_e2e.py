@@ -0,0 +1,283 @@
+"""End-to-end benchmark of devices, gateway and clients.
+
+Starts the native RIOT build on a tap interface (or device_simulator.py on
+loopback), starts the gateway, registers the devices and requests /riot/board,
+/riot/did and /riot/data at fixed rates, from the gateway or from the first
+device directly. Reports p50/p95/p99 latency, throughput and errors per
+resource, the CoAP retransmissions of this client and of the gateway and the
+memory growth of the native device during the run, and writes them as JSON
+together with the commit they were measured on.
+
+    $ sudo ../RIOT/dist/tools/tapsetup/tapsetup -c 1
+    $ python3 benchmark_e2e.py --device native --build --tap tap0 --rate board=20,did=5,data=5 -d 60 --json e2e.json
+    $ python3 benchmark_e2e.py --device simulator -n 200 --latency 20 --rate data=50 -d 30
+"""
+import argparse
+import asyncio
+import datetime
+import json
+import os
+import subprocess
+import sys
+import time
+
+from aiocoap import Context, Message, GET, POST
+
+import gateway_coap_server_client as gateway
+
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+RIOT_APP = os.path.join(HERE, '..', 'coap_server_riot')
+NATIVE_ELF = os.path.join(RIOT_APP, 'bin', 'native', 'nanocoap_server.elf')
+
+GATEWAY = 'coap://[::1]'
+SIMULATOR_PORT = 57000
+
+# Seconds a request may take before it counts as an error
+REQUEST_TIMEOUT = 30
+
+RESOURCES = {
+    'board': '/riot/board',
+    'did': '/riot/did',
+    'data': '/riot/data',
+}
+
+
+def parseRates(text):
+    """'board=20,data=5' -> { '/riot/board': 20.0, '/riot/data': 5.0 }"""
+    rates = {}
+    for item in text.split(','):
+        name, rate = item.split('=')
+        rates[RESOURCES[name]] = float(rate)
+    return rates
+
+
+def percentile(values, p):
+    if not values:
+        return None
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * p / 100))]
+
+
+def commit():
+    try:
+        head = subprocess.run(['git', 'rev-parse', '--short', 'HEAD'], cwd=HERE, capture_output=True, text=True).stdout.strip()
+        dirty = subprocess.run(['git', 'status', '--porcelain', '--untracked-files=no'], cwd=HERE, capture_output=True, text=True).stdout.strip()
+        return head + ('-dirty' if dirty else '')
+    except OSError:
+        return None
+
+
+async def drain(stream, waitFor=None):
+    """Read a process output until waitFor matches a line, returns that line and keeps draining in the background"""
+    while waitFor != None:
+        line = await stream.readline()
+        if not line:
+            raise RuntimeError('process exited before it was ready')
+        line = line.decode('utf-8', 'replace')
+        if waitFor(line):
+            asyncio.create_task(drain(stream))
+            return line
+    while await stream.readline():
+        pass
+
+
+async def startNative(args):
+    """Run the native nanocoap_server on the tap interface, returns (process, device name)"""
+    if args.build:
+        subprocess.run(['make', 'all'], cwd=RIOT_APP, check=True)
+
+    process = await asyncio.create_subprocess_exec(NATIVE_ELF, args.tap, stdout=asyncio.subprocess.PIPE,
+                                                   stderr=asyncio.subprocess.STDOUT)
+    line = await asyncio.wait_for(drain(process.stdout, lambda line: '"IPv6 addresses"' in line), 30)
+    addresses = json.loads(line[line.index('{'):])['IPv6 addresses']
+    address = next(address for address in addresses if address.startswith('fe80'))
+
+    return process, address + '%' + args.tap
+
+
+async def startSimulator(args):
+    """Run device_simulator.py registering its devices at the gateway, returns (process, first device name)"""
+    process = await asyncio.create_subprocess_exec(
+        sys.executable, os.path.join(HERE, 'device_simulator.py'), '-n', str(args.devices), '--port', str(SIMULATOR_PORT),
+        '--latency', str(args.latency), '--jitter', str(args.jitter), '--loss', str(args.loss), '--register', GATEWAY,
+        stdout=asyncio.subprocess.PIPE, stderr=asyncio.subprocess.STDOUT)
+    await asyncio.wait_for(drain(process.stdout, lambda line: line.startswith('Registered')), 30 + args.devices / 10)
+
+    return process, '[::1]:%d' % SIMULATOR_PORT
+
+
+async def startGateway(protocol):
+    """Run the gateway without persistent state and wait until it answers"""
+    env = dict(os.environ, GATEWAY_STATE_DB='')
+    process = await asyncio.create_subprocess_exec(sys.executable, os.path.join(HERE, 'gateway_coap_server_client.py'),
+                                                   cwd=HERE, env=env, stdout=asyncio.subprocess.DEVNULL,
+                                                   stderr=asyncio.subprocess.DEVNULL)
+    for _ in range(50):
+        try:
+            await asyncio.wait_for(getJson(protocol, GATEWAY + '/gateway/stats'), 1)
+            return process
+        except Exception:
+            await asyncio.sleep(0.2)
+    raise RuntimeError('gateway did not start')
+
+
+async def getJson(protocol, uri):
+    response = await protocol.request(Message(code=GET, uri=uri)).response
+    return json.loads(response.payload.decode('utf-8'))
+
+
+def processMemory(pid):
+    """VmRSS and VmData of a process in kB"""
+    memory = {}
+    with open('/proc/%d/status' % pid) as status:
+        for line in status:
+            name, _, value = line.partition(':')
+            if name in ('VmRSS', 'VmData'):
+                memory[name] = int(value.split()[0])
+    return memory
+
+
+async def deviceMemory(protocol, device, process):
+    """/riot/stats of the device (didArena, heap with malloc_monitor) and the memory of the native process"""
+    memory = {}
+    try:
+        memory.update(await asyncio.wait_for(getJson(protocol, gateway.deviceUri(device, '/riot/stats')), 10))
+    except Exception as e:
+        print('No /riot/stats from ' + device + ': ' + str(e))
+    if process != None:
+        memory.update(processMemory(process.pid))
+    return memory
+
+
+async def drive(protocol, uri, rate, duration):
+    """GET uri rate times per second for duration seconds, without waiting for earlier responses"""
+    latencies = []
+    errors = 0
+
+    async def one():
+        nonlocal errors
+        start = time.perf_counter()
+        try:
+            response = await asyncio.wait_for(protocol.request(Message(code=GET, uri=uri)).response, REQUEST_TIMEOUT)
+        except Exception:
+            errors += 1
+            return
+        # Gateway answers list devices that failed with a status
+        if not response.code.is_successful() or b'"status"' in response.payload:
+            errors += 1
+            return
+        latencies.append((time.perf_counter() - start) * 1000)
+
+    loop = asyncio.get_running_loop()
+    start = loop.time()
+    tasks = []
+    for i in range(int(rate * duration)):
+        await asyncio.sleep(max(0, start + i / rate - loop.time()))
+        tasks.append(asyncio.create_task(one()))
+    await asyncio.gather(*tasks)
+    elapsed = loop.time() - start
+
+    return {
+        'requests': len(tasks),
+        'errors': errors,
+        'throughput': len(latencies) / elapsed,
+        'mean_ms': sum(latencies) / len(latencies) if latencies else None,
+        'p50_ms': percentile(latencies, 50),
+        'p95_ms': percentile(latencies, 95),
+        'p99_ms': percentile(latencies, 99),
+    }
+
+
+async def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--device', choices=['native', 'simulator', 'none'], default='simulator',
+                        help="devices to start; none uses a gateway and devices that are already running")
+    parser.add_argument('--build', action='store_true', help="run make all in coap_server_riot first")
+    parser.add_argument('--tap', default='tap0', help="tap interface of the native device")
+    parser.add_argument('-n', '--devices', type=int, default=10, help="simulated devices")
+    parser.add_argument('--latency', type=float, default=0, help="simulated one-way delay in ms")
+    parser.add_argument('--jitter', type=float, default=0, help="simulated delay deviation in ms")
+    parser.add_argument('--loss', type=float, default=0, help="simulated datagram loss")
+    parser.add_argument('--rate', type=parseRates, default='board=10,did=2,data=5', help="requests per second per resource")
+    parser.add_argument('-d', '--duration', type=float, default=30, help="seconds of load")
+    parser.add_argument('--warmup', type=float, default=5, help="seconds between start and load")
+    parser.add_argument('--direct', action='store_true', help="request the first device instead of the gateway")
+    parser.add_argument('--json', metavar='FILE', help="write the results to FILE")
+    args = parser.parse_args()
+
+    protocol = await Context.create_client_context()
+    processes = []
+    deviceProcess = None
+    device = None
+
+    try:
+        if args.device != 'none':
+            processes.append(await startGateway(protocol))
+        if args.device == 'native':
+            deviceProcess, device = await startNative(args)
+            processes.append(deviceProcess)
+            await protocol.request(Message(code=POST, uri=GATEWAY + '/newdevice', payload=json.dumps(
+                {'ipv6': device.split('%')[0], 'interface': args.tap}).encode('utf-8'))).response
+        elif args.device == 'simulator':
+            simulator, device = await startSimulator(args)
+            processes.append(simulator)
+
+        await asyncio.sleep(args.warmup)
+
+        if args.direct and device == None:
+            raise RuntimeError('--direct needs a device that is started here')
+        base = gateway.deviceUri(device, '') if args.direct else GATEWAY
+
+        memoryBefore = await deviceMemory(protocol, device, deviceProcess) if device != None else {}
+        retransmissionsBefore = gateway.retransmissions.count
+        gatewayBefore = await getJson(protocol, GATEWAY + '/gateway/stats')
+
+        results = await asyncio.gather(*(drive(protocol, base + path, rate, args.duration) for path, rate in args.rate.items()))
+
+        gatewayAfter = await getJson(protocol, GATEWAY + '/gateway/stats')
+        memoryAfter = await deviceMemory(protocol, device, deviceProcess) if device != None else {}
+    finally:
+        for process in processes:
+            if process.returncode == None:
+                process.terminate()
+                await process.wait()
+        await protocol.shutdown()
+
+    report = {
+        'commit': commit(),
+        'time': datetime.datetime.now(datetime.timezone.utc).isoformat(),
+        'device': args.device,
+        'devices': args.devices if args.device == 'simulator' else 1,
+        'direct': args.direct,
+        'duration_s': args.duration,
+        'resources': dict(zip(args.rate, results)),
+        'retransmissions': {
+            'client': gateway.retransmissions.count - retransmissionsBefore,
+            'gateway': gatewayAfter['retransmissions'] - gatewayBefore['retransmissions'],
+        },
+        'device_memory': {
+            'before': memoryBefore,
+            'after': memoryAfter,
+            'growth': {key: memoryAfter[key] - memoryBefore[key] for key in memoryBefore
+                       if isinstance(memoryBefore[key], int) and key in memoryAfter},
+        },
+        'gateway': gatewayAfter,
+    }
+
+    print('%-12s %9s %7s %10s %9s %9s %9s' % ('resource', 'requests', 'errors', 'req/s', 'p50 ms', 'p95 ms', 'p99 ms'))
+    for path, result in report['resources'].items():
+        print('%-12s %9d %7d %10.1f %9s %9s %9s' % (
+            path, result['requests'], result['errors'], result['throughput'],
+            *('%.1f' % result[key] if result[key] != None else '-' for key in ('p50_ms', 'p95_ms', 'p99_ms'))))
+    print('retransmissions: client %(client)d, gateway %(gateway)d' % report['retransmissions'])
+    if report['device_memory']['growth']:
+        print('device memory growth: ' + json.dumps(report['device_memory']['growth']))
+
+    if args.json:
+        with open(args.json, 'w') as out:
+            json.dump(report, out, indent=2)
+
+
+if __name__ == "__main__":
+    asyncio.run(main())
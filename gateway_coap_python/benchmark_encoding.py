@@ -0,0 +1,107 @@
+"""Size and latency comparison of the text (base64url JSON), CBOR and COSE encodings.
+
+Fetches /riot/did and /riot/data from one device with each Accept value and
+reports the payload size, the request latency (including all Block2 blocks)
+and the time the gateway needs to decode and verify the payload.
+
+    $ python3 benchmark_encoding.py 'fe80::381e:40ff:febf:26bf%tap0' -n 20
+"""
+import argparse
+import asyncio
+import contextlib
+import io
+import json
+import statistics
+import time
+
+from aiocoap import Context, Message, GET
+
+import gateway_coap_server_client as gateway
+
+
+ENCODINGS = gateway.DEVICE_FORMATS
+
+
+async def verifyDid(protocol, device, response):
+    if response.opt.content_format == gateway.CONTENT_FORMAT_COSE_SIGN1:
+        return gateway.verifyDiDCose(response.payload)
+    return gateway.verifyDiD(gateway.payloadToText(response.payload, response.opt.content_format))
+
+
+async def verifyData(protocol, device, response):
+    if response.opt.content_format == gateway.CONTENT_FORMAT_COSE_SIGN1:
+        return await gateway.verifyDataCose(protocol, device, response.payload)
+    return await gateway.verifyData(gateway.payloadToText(response.payload, response.opt.content_format))
+
+
+RESOURCES = {
+    '/riot/did': verifyDid,
+    '/riot/data': verifyData,
+}
+
+
+def summary(values):
+    values = sorted(values)
+    return {
+        'mean': statistics.mean(values),
+        'p50': values[len(values) // 2],
+        'p95': values[min(len(values) - 1, int(len(values) * 0.95))],
+    }
+
+
+async def measure(protocol, device, path, contentFormat, verify, count):
+    sizes = []
+    latencies = []
+    verifyTimes = []
+
+    for _ in range(count):
+        request = Message(code=GET, uri='coap://[' + device + ']' + path, accept=contentFormat)
+
+        start = time.perf_counter()
+        response = await protocol.request(request).response
+        latencies.append((time.perf_counter() - start) * 1000)
+
+        sizes.append(len(response.payload))
+
+        start = time.perf_counter()
+        with contextlib.redirect_stdout(io.StringIO()):
+            await verify(protocol, device, response)
+        verifyTimes.append((time.perf_counter() - start) * 1000)
+
+    return {
+        'bytes': statistics.mean(sizes),
+        'latency_ms': summary(latencies),
+        'decode_verify_ms': summary(verifyTimes),
+    }
+
+
+async def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('device', help="device address as used by the gateway, e.g. 'fe80::1%%tap0'")
+    parser.add_argument('-n', '--count', type=int, default=10, help="requests per resource and encoding")
+    parser.add_argument('--json', action='store_true', help="print machine-readable results")
+    args = parser.parse_args()
+
+    protocol = await Context.create_client_context()
+    results = {}
+
+    for path, verify in RESOURCES.items():
+        for name, contentFormat in ENCODINGS.items():
+            results[path + ' ' + name] = await measure(protocol, args.device, path, contentFormat, verify, args.count)
+
+    await protocol.shutdown()
+
+    if args.json:
+        print(json.dumps(results, indent=2))
+        return
+
+    print('%-18s %8s %10s %10s %10s %12s' % ('resource', 'bytes', 'mean ms', 'p50 ms', 'p95 ms', 'verify ms'))
+    for name, result in results.items():
+        print('%-18s %8.0f %10.1f %10.1f %10.1f %12.2f' % (
+            name, result['bytes'],
+            result['latency_ms']['mean'], result['latency_ms']['p50'], result['latency_ms']['p95'],
+            result['decode_verify_ms']['mean']))
+
+
+if __name__ == "__main__":
+    asyncio.run(main())
@@ -0,0 +1,96 @@
+"""Ed25519 verifications per second of the gateway verify pool against the number of workers.
+
+Signs readings with a local key and verifies them through gateway.verifyInPool
+inline (on the event loop), on a thread pool and on a process pool with 1 up
+to all cores. The loop lag is the longest delay of a 1 ms timer while the
+verifications run, i.e. how long other CoAP traffic would have been stalled.
+
+    $ python3 benchmark_verify.py -n 5000
+"""
+import argparse
+import asyncio
+import json
+import os
+import time
+
+import ed25519
+
+import gateway_coap_server_client as gateway
+
+
+def workerCounts(cores):
+    counts = []
+    workers = 1
+    while workers < cores:
+        counts.append(workers)
+        workers *= 2
+    return counts + [cores]
+
+
+async def loopLag(stop):
+    """Longest delay of a 1 ms sleep until stop is set"""
+    lag = 0
+    while not stop.is_set():
+        start = time.perf_counter()
+        await asyncio.sleep(0.001)
+        lag = max(lag, time.perf_counter() - start - 0.001)
+    return lag
+
+
+async def measure(kind, workers, verifyKey, signature, message, count):
+    gateway.verifyPool = gateway.createVerifyPool(kind, workers)
+
+    # Start the workers before timing
+    await asyncio.gather(*(gateway.verifyInPool(gateway.verifySignature, verifyKey, signature, message) for _ in range(workers)))
+
+    stop = asyncio.Event()
+    lag = asyncio.create_task(loopLag(stop))
+    await asyncio.sleep(0)
+
+    start = time.perf_counter()
+    results = await asyncio.gather(*(gateway.verifyInPool(gateway.verifySignature, verifyKey, signature, message) for _ in range(count)))
+    elapsed = time.perf_counter() - start
+
+    stop.set()
+    maxLag = await lag
+
+    if gateway.verifyPool != None:
+        gateway.verifyPool.shutdown()
+        gateway.verifyPool = None
+
+    return {
+        'verifications_per_s': count / elapsed,
+        'loop_lag_ms': maxLag * 1000,
+        'valid': all(results),
+    }
+
+
+async def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('-n', '--count', type=int, default=2000, help="verifications per pool")
+    parser.add_argument('--cores', type=int, default=os.cpu_count() or 1, help="largest number of workers")
+    parser.add_argument('--json', action='store_true', help="print machine-readable results")
+    args = parser.parse_args()
+
+    signingKey, verifyKey = ed25519.create_keypair()
+    message = gateway.base64UrlEncode(json.dumps({'temperature': 21.5}).encode('utf-8'))
+    signature = signingKey.sign(message)
+
+    results = {'inline 1': await measure('none', 1, verifyKey, signature, message, args.count)}
+    for kind in ('thread', 'process'):
+        for workers in workerCounts(args.cores):
+            results['%s %d' % (kind, workers)] = await measure(kind, workers, verifyKey, signature, message, args.count)
+
+    if args.json:
+        print(json.dumps(results, indent=2))
+        return
+
+    print('%-12s %14s %14s' % ('pool', 'verify/s', 'loop lag ms'))
+    for name, result in results.items():
+        print('%-12s %14.0f %14.1f%s' % (
+            name, result['verifications_per_s'], result['loop_lag_ms'],
+            '' if result['valid'] else '  INVALID'))
+
+
+if __name__ == "__main__":
+    asyncio.run(main())
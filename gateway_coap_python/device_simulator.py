@@ -0,0 +1,394 @@
+"""Virtual did:self devices on loopback for load-testing the gateway.
+
+Every device listens on its own port of ::1 and serves /.well-known/core,
+/riot/board, /riot/did (text, CBOR, COSE_Sign1), /riot/did/document,
+/riot/did/proof, /riot/data (signed per reading, observable) and /riot/stats
+with the same wire formats, ETags, Max-Age values and 64 byte Block2 blocks as
+coap_handler.c. Keys are real Ed25519 keys and every reading is really signed.
+Latency, jitter and loss are applied to every request and reply.
+
+    $ python3 device_simulator.py -n 1000 --latency 20 --jitter 10 --loss 0.01 --register 'coap://[::1]'
+
+The devices are named [::1]:<port> in the gateway; --register adds them to the
+resource directory of a running gateway. Epoch-signed data is not simulated.
+"""
+import argparse
+import asyncio
+import hashlib
+import json
+import random
+import resource
+import time
+from base64 import urlsafe_b64encode
+
+import cbor2
+import ed25519
+
+from aiocoap import Context, Message, POST
+from aiocoap.numbers.codes import Code
+from aiocoap.numbers.types import Type
+from aiocoap.optiontypes import BlockOption
+
+
+BASE_PORT = 57000
+
+# Same values as the defaults of coap_handler.c and the Makefile
+BOARD = 'native'
+BLOCK_SZX = 2
+BOARD_MAX_AGE = 86400
+DID_MAX_AGE = 3600
+DATA_MAX_AGE = 5
+OBSERVE_INTERVAL = 60
+TEMPERATURE = 25
+SCALE = 'C'
+
+CONTENT_FORMAT_TEXT = 0
+CONTENT_FORMAT_COSE_SIGN1 = 18
+CONTENT_FORMAT_LINK = 40
+CONTENT_FORMAT_JSON = 50
+CONTENT_FORMAT_CBOR = 60
+
+# Resource byte of the ETag, after the first bytes of s256
+ETAG_DID = b'd'
+ETAG_DOCUMENT = b'D'
+ETAG_PROOF = b'p'
+
+LINKS = '</riot/board>,</riot/did>,</riot/did/document>,</riot/did/proof>,</riot/data>,</riot/stats>'
+
+
+def b64(data):
+    """base64url without padding, as bytes_to_base64url() of the device"""
+    return urlsafe_b64encode(data).rstrip(b'=').decode('ascii')
+
+
+def compact(obj):
+    return json.dumps(obj, separators=(',', ':'))
+
+
+def coseSign1(kid, payload, signingKey):
+    """Untagged COSE_Sign1 with EdDSA, like coseSign1() of the device"""
+    protected = cbor2.dumps({1: -8, 4: kid})
+    signature = signingKey.sign(cbor2.dumps(['Signature1', protected, b'', payload]))
+    return cbor2.dumps([protected, {}, payload, signature])
+
+
+class VirtualDid:
+    """Keys and all representations of one DID, serialized once like cacheDidResponses()"""
+
+    def __init__(self):
+        proofKey, proofPublic = ed25519.create_keypair()
+        self.documentKey, documentPublic = ed25519.create_keypair()
+
+        proofJwk = {'kty': 'OKP', 'crv': 'Ed25519', 'x': b64(proofPublic.to_bytes())}
+        documentJwk = {'kty': 'OKP', 'crv': 'Ed25519', 'x': b64(documentPublic.to_bytes())}
+
+        thumbprint = hashlib.sha256(compact({'crv': 'Ed25519', 'kty': 'OKP', 'x': proofJwk['x']}).encode('utf-8')).digest()
+        document = {'id': 'did:self:' + b64(thumbprint),
+                    'attestation': {'id': '#key1', 'type': 'JsonWebKey2020', 'publicKeyJwk': documentJwk}}
+
+        iat = int(time.time())
+        exp = iat + 365 * 86400
+        s256 = hashlib.sha256(compact(document).encode('utf-8')).digest()
+
+        header = {'alg': 'EdDSA', 'jwk': proofJwk}
+        payload = {'iat': iat, 'exp': exp, 's256': b64(s256)}
+        signingInput = b64(compact(header).encode('utf-8')) + '.' + b64(compact(payload).encode('utf-8'))
+        signature = proofKey.sign(signingInput.encode('utf-8'))
+
+        #TEXT
+        self.text = b64(compact(document).encode('utf-8')) + ' ' + signingInput + '.' + b64(signature)
+        self.documentText = compact(document)
+        self.proofText = compact({'header': header, 'payload': payload, 'signature': b64(signature)})
+
+        #CBOR, BASE64URL VALUES AS BYTE STRINGS AND TIMESTAMPS AS INTEGERS
+        def jwkCbor(jwk, public):
+            return {'kty': jwk['kty'], 'crv': jwk['crv'], 'x': public.to_bytes()}
+
+        self.documentCbor = {'id': document['id'],
+                             'attestation': {'id': '#key1', 'type': 'JsonWebKey2020', 'publicKeyJwk': jwkCbor(documentJwk, documentPublic)}}
+        self.proofCbor = {'header': {'alg': 'EdDSA', 'jwk': jwkCbor(proofJwk, proofPublic)},
+                          'payload': {'iat': iat, 'exp': exp, 's256': s256},
+                          'signature': signature}
+        self.cbor = cbor2.dumps([self.documentCbor, self.proofCbor])
+
+        #COSE_SIGN1 SIGNED BY THE PROOF KEY, KID IS THE THUMBPRINT
+        self.cose = coseSign1(thumbprint, cbor2.dumps({'document': self.documentCbor, 'iat': iat, 'exp': exp,
+                                                       'x': proofPublic.to_bytes()}), proofKey)
+        self.dataKid = thumbprint[:8]
+        self.etagHash = s256[:6]
+
+    def representations(self, tag):
+        """{ content format: payload } of /riot/did, /riot/did/document or /riot/did/proof"""
+        if tag == ETAG_DID:
+            return {CONTENT_FORMAT_TEXT: self.text.encode('utf-8'), CONTENT_FORMAT_CBOR: self.cbor, CONTENT_FORMAT_COSE_SIGN1: self.cose}
+        if tag == ETAG_DOCUMENT:
+            return {CONTENT_FORMAT_TEXT: self.documentText.encode('utf-8'), CONTENT_FORMAT_CBOR: cbor2.dumps(self.documentCbor)}
+        return {CONTENT_FORMAT_TEXT: self.proofText.encode('utf-8'), CONTENT_FORMAT_CBOR: cbor2.dumps(self.proofCbor)}
+
+    def reading(self, contentFormat):
+        """A newly signed reading in a content format, like storeDataReading()"""
+        reading = {'temperature': TEMPERATURE, 'scale': SCALE}
+
+        if contentFormat == CONTENT_FORMAT_COSE_SIGN1:
+            return coseSign1(self.dataKid, cbor2.dumps(reading), self.documentKey)
+
+        data = b64(compact(reading).encode('utf-8'))
+        signature = self.documentKey.sign(data.encode('utf-8'))
+
+        if contentFormat == CONTENT_FORMAT_CBOR:
+            return cbor2.dumps([self.documentCbor, self.proofCbor, {'payload': reading, 'signature': signature}])
+        return (self.text + ' ' + data + '.' + b64(signature)).encode('utf-8')
+
+
+def acceptedFormat(request):
+    accept = request.opt.accept
+    if accept == None:
+        return CONTENT_FORMAT_TEXT
+    if accept in (CONTENT_FORMAT_TEXT, CONTENT_FORMAT_CBOR, CONTENT_FORMAT_COSE_SIGN1):
+        return int(accept)
+    return None
+
+
+class VirtualDevice(asyncio.DatagramProtocol):
+    """One device on its own UDP port, with the latency and loss of its link"""
+
+    def __init__(self, port, args):
+        self.port = port
+        self.args = args
+        self.did = VirtualDid()
+        self.transport = None
+        self.mid = random.randrange(0x10000)
+        # Last reading per content format with its ETag, later blocks are cut from it
+        self.readings = {}
+        self.readingCount = random.randrange(1 << 32)
+        # Observers of /riot/data: { (address, token): content format }
+        self.observers = {}
+        self.observeSeq = 0
+        self.stats = {'requests': 0, 'dropped': 0, 'signatures': 0}
+
+    def connection_made(self, transport):
+        self.transport = transport
+
+    def nextMid(self):
+        self.mid = (self.mid + 1) & 0xffff
+        return self.mid
+
+    def lost(self):
+        if random.random() < self.args.loss:
+            self.stats['dropped'] += 1
+            return True
+        return False
+
+    def delay(self):
+        return max(0.0, random.gauss(self.args.latency, self.args.jitter) / 1000)
+
+    def send(self, message, address):
+        if not self.lost():
+            self.transport.sendto(message.encode(), address)
+
+    def datagram_received(self, data, address):
+        if self.lost():
+            return
+        try:
+            request = Message.decode(data)
+        except Exception:
+            return
+
+        if request.code == Code.EMPTY:
+            # CoAP ping, or an observer that rejects notifications
+            if request.mtype == Type.CON:
+                self.send(Message(mtype=Type.RST, mid=request.mid, code=Code.EMPTY), address)
+            elif request.mtype == Type.RST:
+                self.observers = {key: value for key, value in self.observers.items() if key[0] != address}
+            return
+        if request.mtype not in (Type.CON, Type.NON):
+            return
+
+        self.stats['requests'] += 1
+        asyncio.get_running_loop().call_later(self.delay(), self.reply, request, address)
+
+    def reply(self, request, address):
+        response = self.handle(request, address)
+
+        if request.mtype == Type.CON:
+            response.mtype = Type.ACK
+            response.mid = request.mid
+        else:
+            response.mtype = Type.NON
+            response.mid = self.nextMid()
+        response.token = request.token
+
+        self.send(response, address)
+
+    def handle(self, request, address):
+        path = '/' + '/'.join(request.opt.uri_path)
+
+        if request.code != Code.GET:
+            return Message(code=Code.METHOD_NOT_ALLOWED)
+        if path == '/.well-known/core':
+            return self.blockwise(request, LINKS.encode('ascii'), CONTENT_FORMAT_LINK)
+        if path == '/riot/board':
+            return self.blockwise(request, BOARD.encode('ascii'), CONTENT_FORMAT_TEXT, max_age=BOARD_MAX_AGE)
+        if path == '/riot/did':
+            return self.negotiated(request, ETAG_DID)
+        if path == '/riot/did/document':
+            return self.negotiated(request, ETAG_DOCUMENT)
+        if path == '/riot/did/proof':
+            return self.negotiated(request, ETAG_PROOF)
+        if path == '/riot/data':
+            return self.data(request, address)
+        if path == '/riot/stats':
+            stats = compact({'signatures': self.stats['signatures'], 'selfChecks': 0, 'selfCheckFailures': 0})
+            return self.blockwise(request, stats.encode('ascii'), CONTENT_FORMAT_JSON)
+        return Message(code=Code.NOT_FOUND)
+
+    def blockwise(self, request, payload, contentFormat, etag=None, max_age=None, observe=None):
+        """2.05 with the block of payload asked for, like replyBlockwiseOpts()"""
+        szx = BLOCK_SZX
+        number = 0
+        if request != None and request.opt.block2 != None:
+            szx = min(szx, request.opt.block2.size_exponent)
+            number = request.opt.block2.block_number
+
+        size = 16 << szx
+        if number * size >= max(len(payload), 1):
+            return Message(code=Code.BAD_OPTION)
+
+        response = Message(code=Code.CONTENT, payload=payload[number * size:(number + 1) * size])
+        response.opt.content_format = contentFormat
+        if len(payload) > size or number > 0:
+            response.opt.block2 = BlockOption.BlockwiseTuple(number, (number + 1) * size < len(payload), szx)
+        if etag != None:
+            response.opt.etag = etag
+        if max_age != None:
+            response.opt.max_age = max_age
+        if observe != None:
+            response.opt.observe = observe
+        return response
+
+    def negotiated(self, request, tag):
+        contentFormat = acceptedFormat(request)
+        payload = self.did.representations(tag).get(contentFormat)
+        if payload == None:
+            return Message(code=Code.NOT_ACCEPTABLE)
+
+        etag = self.did.etagHash + tag + bytes([contentFormat])
+        if etag in request.opt.etags:
+            response = Message(code=Code.VALID)
+            response.opt.etag = etag
+            response.opt.max_age = DID_MAX_AGE
+            return response
+
+        return self.blockwise(request, payload, contentFormat, etag=etag, max_age=DID_MAX_AGE)
+
+    def data(self, request, address):
+        contentFormat = acceptedFormat(request)
+        if contentFormat == None:
+            return Message(code=Code.NOT_ACCEPTABLE)
+
+        # A new reading is signed for the first block only, a later block of an older reading is refused
+        observe = None
+        if request.opt.block2 == None or request.opt.block2.block_number == 0 or contentFormat not in self.readings:
+            self.signReading(contentFormat)
+
+            key = (address, request.token)
+            if request.opt.observe == 0 and len(self.observers) < self.args.observers:
+                self.observers[key] = contentFormat
+                observe = self.observeSeq
+            elif request.opt.observe == 1 or key in self.observers:
+                self.observers.pop(key, None)
+        elif request.opt.etags and self.readings[contentFormat][1] not in request.opt.etags:
+            return Message(code=Code.REQUEST_ENTITY_INCOMPLETE)
+
+        payload, etag = self.readings[contentFormat]
+        return self.blockwise(request, payload, contentFormat, etag=etag, max_age=DATA_MAX_AGE, observe=observe)
+
+    def signReading(self, contentFormat):
+        """Sign a new reading into the buffer of a content format, like storeDataReading()"""
+        self.readingCount = (self.readingCount + 1) & 0xffffffff
+        etag = self.readingCount.to_bytes(4, 'big') + bytes([contentFormat])
+        self.readings[contentFormat] = (self.did.reading(contentFormat), etag)
+        self.stats['signatures'] += 1
+
+    def notify(self):
+        """Send a newly signed reading to every observer, as NON notifications.
+        Observers of the same content format get the same reading."""
+        if not self.observers:
+            return
+
+        self.observeSeq = (self.observeSeq + 1) & 0xffffff
+        for contentFormat in set(self.observers.values()):
+            self.signReading(contentFormat)
+
+        for (address, token), contentFormat in self.observers.items():
+            payload, etag = self.readings[contentFormat]
+            notification = self.blockwise(None, payload, contentFormat, etag=etag,
+                                          max_age=self.args.observe_interval, observe=self.observeSeq)
+            notification.mtype = Type.NON
+            notification.mid = self.nextMid()
+            notification.token = token
+            self.send(notification, address)
+
+
+async def registerDevices(devices, gateway, lifetime):
+    """Register every device in the resource directory of the gateway"""
+    protocol = await Context.create_client_context()
+    limit = asyncio.Semaphore(32)
+
+    async def register(device):
+        async with limit:
+            uri = '%s/rd?ep=sim%d&lt=%d&base=coap://[::1]:%d' % (gateway, device.port, lifetime, device.port)
+            response = await protocol.request(Message(code=POST, uri=uri, payload=LINKS.encode('ascii'))).response
+            return response.code.is_successful()
+
+    results = await asyncio.gather(*(register(device) for device in devices), return_exceptions=True)
+    print('Registered %d of %d devices at %s' % (sum(result is True for result in results), len(devices), gateway))
+
+    await protocol.shutdown()
+
+
+async def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('-n', '--devices', type=int, default=100, help="virtual devices")
+    parser.add_argument('--port', type=int, default=BASE_PORT, help="port of the first device")
+    parser.add_argument('--latency', type=float, default=0, help="mean one-way delay of a reply in ms")
+    parser.add_argument('--jitter', type=float, default=0, help="standard deviation of the delay in ms")
+    parser.add_argument('--loss', type=float, default=0, help="probability that a datagram is lost, in each direction")
+    parser.add_argument('--observers', type=int, default=2, help="observers of /riot/data per device")
+    parser.add_argument('--observe-interval', type=int, default=OBSERVE_INTERVAL, help="seconds between notifications")
+    parser.add_argument('--register', metavar='GATEWAY', help="register the devices at the gateway, e.g. 'coap://[::1]'")
+    parser.add_argument('--lifetime', type=int, default=3600, help="lifetime of the registrations in seconds")
+    args = parser.parse_args()
+
+    # One socket per device
+    soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+    resource.setrlimit(resource.RLIMIT_NOFILE, (max(soft, min(hard, args.devices + 256)), hard))
+
+    loop = asyncio.get_running_loop()
+    devices = []
+    for port in range(args.port, args.port + args.devices):
+        _, device = await loop.create_datagram_endpoint(lambda port=port: VirtualDevice(port, args), local_addr=('::1', port))
+        devices.append(device)
+    print('%d devices on [::1]:%d-%d' % (len(devices), args.port, args.port + args.devices - 1))
+
+    if args.register:
+        await registerDevices(devices, args.register, args.lifetime)
+
+    last = {'requests': 0, 'dropped': 0, 'signatures': 0}
+    while True:
+        await asyncio.sleep(args.observe_interval)
+        for device in devices:
+            device.notify()
+
+        total = {key: sum(device.stats[key] for device in devices) for key in last}
+        print('%.0f requests/s, %d dropped, %d signatures, %d observers' % (
+            (total['requests'] - last['requests']) / args.observe_interval, total['dropped'] - last['dropped'],
+            total['signatures'] - last['signatures'], sum(len(device.observers) for device in devices)))
+        last = total
+
+
+if __name__ == "__main__":
+    try:
+        asyncio.run(main())
+    except KeyboardInterrupt:
+        pass
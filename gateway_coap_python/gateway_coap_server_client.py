@@ -16,6 +16,33 @@ import jwt
 from jwcrypto import jwk, jws
 
 import ed25519
+import cbor2
+import os
+import re
+import signal
+import sqlite3
+import time
+import functools
+import concurrent.futures
+
+# Content formats a device can answer with, chosen with the Accept option
+CONTENT_FORMAT_TEXT = 0
+CONTENT_FORMAT_COSE_SIGN1 = 18
+CONTENT_FORMAT_CBOR = 60
+
+DEVICE_FORMATS = {
+    'text': CONTENT_FORMAT_TEXT,
+    'cbor': CONTENT_FORMAT_CBOR,
+    'cose': CONTENT_FORMAT_COSE_SIGN1,
+}
+
+# Representation the gateway asks devices for (text/base64url JSON by default)
+DEVICE_FORMAT = DEVICE_FORMATS.get(os.environ.get('GATEWAY_DEVICE_FORMAT', 'text'), CONTENT_FORMAT_TEXT)
+
+# COSE header labels and algorithm (RFC 9052/9053)
+COSE_HEADER_ALG = 1
+COSE_HEADER_KID = 4
+COSE_ALG_EDDSA = -8
 
 def base64UrlEncode(data):
     return urlsafe_b64encode(data).rstrip(b'=')
@@ -27,34 +54,544 @@ def base64UrlDecode(base64Url):
     return urlsafe_b64decode(base64Url + padding)
 
 
-devices = { 'all': ['aaa'] }
+# Lifetime of a registration without the lt parameter (RFC 9176 5.3)
+RD_DEFAULT_LIFETIME = 90000
 
 
-class RiotBoard(resource.Resource):
-    async def render_get(self, request):
-        protocol = await Context.create_client_context()
+def parseLinkFormat(text):
+    """Targets of a link-format document (RFC 6690) with their resource types: { '/riot/board': ['rt', ...] }"""
+    links = {}
+    for target, attributes in re.findall(r'<([^>]*)>([^<]*)', text):
+        links[target] = re.findall(r';rt="?([^";,]*)"?', attributes)
+    return links
+
+
+class Registration:
+    """A device registered in the resource directory, links is None when its resources are unknown"""
+    
+    def __init__(self, location, ep, device, lifetime, links):
+        self.location = location
+        self.ep = ep
+        self.device = device
+        self.links = links
+        self.refresh(lifetime)
+    
+    def refresh(self, lifetime):
+        self.lifetime = lifetime
+        self.expires = time.monotonic() + lifetime
+    
+    def keys(self):
+        """Resources the registration is indexed under: link targets and resource types"""
+        if self.links == None:
+            return set()
+        return set(self.links) | {rt for types in self.links.values() for rt in types}
+
+
+class ResourceDirectory:
+    """Device registrations (RFC 9176) with lifetimes: { location: Registration },
+    one registration per endpoint name and an index { link target or rt: set of locations }."""
+    
+    def __init__(self):
+        self.registrations = {}
+        self.locations = {}
+        self.index = {}
+        self.nextId = 1
+        # Called with every registration that is created or changed, and with every one that is removed or expires
+        self.onChange = None
+        self.onRemove = None
+    
+    def register(self, ep, device, lifetime, links, location=None):
+        """Add or replace the registration of an endpoint, returns (Registration, True if it is new).
+        A location is only given when a registration of an earlier run is restored."""
+        existing = self.locations.get(ep)
+        if existing != None:
+            registration = self.registrations[existing]
+            self.unindex(registration)
+            registration.device = device
+            registration.links = links
+            registration.refresh(lifetime)
+            self.indexLinks(registration)
+            self.changed(registration)
+            return registration, False
+        
+        if location == None:
+            location = str(self.nextId)
+        self.nextId = max(self.nextId, int(location) + 1)
+        
+        registration = Registration(location, ep, device, lifetime, links)
+        self.registrations[location] = registration
+        self.locations[ep] = location
+        self.indexLinks(registration)
+        self.changed(registration)
+        return registration, True
+    
+    def update(self, location, lifetime=None, links=None):
+        registration = self.registrations.get(location)
+        if registration == None:
+            return None
+        
+        if links != None:
+            self.unindex(registration)
+            registration.links = links
+            self.indexLinks(registration)
+        registration.refresh(lifetime if lifetime != None else registration.lifetime)
+        self.changed(registration)
+        return registration
+    
+    def remove(self, location):
+        registration = self.registrations.pop(location, None)
+        if registration == None:
+            return None
         
-        allResponses = []
+        self.locations.pop(registration.ep, None)
+        self.unindex(registration)
+        if self.onRemove != None:
+            self.onRemove(registration)
+        return registration
+    
+    def changed(self, registration):
+        if self.onChange != None:
+            self.onChange(registration)
+    
+    def expire(self):
+        now = time.monotonic()
+        for location in [location for location, registration in self.registrations.items() if registration.expires <= now]:
+            print('Registration of ' + self.registrations[location].ep + ' expired')
+            self.remove(location)
+    
+    def indexLinks(self, registration):
+        for key in registration.keys():
+            self.index.setdefault(key, set()).add(registration.location)
+    
+    def unindex(self, registration):
+        for key in registration.keys():
+            locations = self.index.get(key)
+            if locations != None:
+                locations.discard(registration.location)
+                if not locations:
+                    del self.index[key]
+    
+    def lookup(self, link=None):
+        """Live registrations that advertise a link target or resource type (all of them for None)"""
+        self.expire()
         
-        for device in devices['all']:
+        indexed = self.index.get(link, set())
+        return [registration for location, registration in self.registrations.items()
+                if link == None or registration.links == None or location in indexed]
+    
+    def endpoints(self, link=None):
+        """Devices that advertise a link target or resource type, in registration order"""
+        return list(dict.fromkeys(registration.device for registration in self.lookup(link)))
+
+
+directory = ResourceDirectory()
+
+
+# Client context shared by all resources and observations, created in main()
+clientContext = None
+
+
+def isIpv6(host):
+    """True for an IPv6 address (with zone), which has to be bracketed in a URI"""
+    return host.count(':') >= 2
+
+
+def deviceUri(device, path):
+    """URI of a resource of a device, given as an IPv6 address (with zone), as [address]:port
+    or as an IPv4 address or host name with an optional :port"""
+    if isIpv6(device) and not device.startswith('['):
+        return 'coap://[' + device + ']' + path
+    return 'coap://' + device + path
+
+
+# Devices asked at the same time, and the seconds each device gets to answer
+FANOUT_CONCURRENCY = int(os.environ.get('GATEWAY_FANOUT_CONCURRENCY', '8'))
+DEVICE_TIMEOUT = float(os.environ.get('GATEWAY_DEVICE_TIMEOUT', '10'))
+
+fanOutLimit = asyncio.Semaphore(FANOUT_CONCURRENCY)
 
-            request = Message(code=GET, uri='coap://[' + device + ']/riot/board')
 
+async def fanOut(askDevice, link=None):
+    """Run askDevice(device) for the devices that advertise link concurrently, each with its own deadline.
+    Returns the answers that arrived (in device order, None answers left out) and
+    { device: 'timeout' | 'error' } for the devices that did not answer."""
+    async def ask(device):
+        async with fanOutLimit:
             try:
-                response = await protocol.request(request).response
+                return await asyncio.wait_for(askDevice(device), DEVICE_TIMEOUT), None
+            except asyncio.TimeoutError:
+                print('Device ' + device + ' timed out')
+                return None, 'timeout'
             except Exception as e:
                 print('Failed to fetch resource:')
                 print(e)
-            else:
-                print('Result: %s\n%r'%(response.code, response.payload))
-                
-                allResponses.append(response.payload.decode('utf-8'))
-                
+                return None, 'error'
+    
+    targets = directory.endpoints(link)
+    answers = await asyncio.gather(*(ask(device) for device in targets))
+    
+    results = [result for result, status in answers if result != None]
+    statuses = {device: status for device, (result, status) in zip(targets, answers) if status != None}
+    
+    return results, statuses
+
+
+def statusEntries(statuses):
+    """JSON entries for the devices that did not answer"""
+    return [jsonCompact({'device': device, 'status': status}) for device, status in statuses.items()]
+
+
+# Default Max-Age of a CoAP response without the option (RFC 7252 5.10.5)
+DEFAULT_MAX_AGE = 60
+
+# Serve device responses from the cache while their Max-Age lasts (GATEWAY_CACHE=0 disables it)
+CACHE_ENABLED = os.environ.get('GATEWAY_CACHE', '1') != '0'
+
 
-        result = '[' + ','.join(allResponses) + ']'
+class ResponseCache:
+    """Device responses kept for their Max-Age: { (device, path, accept): (expiry, response) }"""
+    
+    def __init__(self):
+        self.entries = {}
+        self.hits = 0
+        self.misses = 0
+    
+    def get(self, key):
+        entry = self.entries.get(key)
+        if entry != None and entry[0] > time.monotonic():
+            self.hits += 1
+            return entry[1]
+        
+        self.entries.pop(key, None)
+        self.misses += 1
+        return None
+    
+    def fresh(self, key):
+        entry = self.entries.get(key)
+        return entry != None and entry[0] > time.monotonic()
+    
+    def put(self, key, response):
+        """Keep a 2.05 response. A 2.03 Valid answers the ETags of one request and has no payload,
+        so it is not kept: it would be returned to requests that sent no ETag."""
+        now = time.monotonic()
+        for expired in [k for k, entry in self.entries.items() if entry[0] <= now]:
+            del self.entries[expired]
+        
+        maxAge = response.opt.max_age if response.opt.max_age != None else DEFAULT_MAX_AGE
+        if response.code == CONTENT and maxAge > 0:
+            self.entries[key] = (now + maxAge, response)
+    
+    def stats(self):
+        return {'hits': self.hits, 'misses': self.misses, 'entries': len(self.entries)}
+
+
+responseCache = ResponseCache()
+
+
+async def fetchCached(protocol, device, path, accept=None, etags=None):
+    """GET a resource of a device, served from the response cache while it is fresh.
+    Returns (response, True if it came from the cache)."""
+    key = (device, path, accept)
+    
+    if CACHE_ENABLED:
+        response = responseCache.get(key)
+        if response != None:
+            return response, True
+    
+    request = Message(code=GET, uri=deviceUri(device, path))
+    if accept != None:
+        request.opt.accept = accept
+    if etags:
+        request.opt.etags = etags
+    
+    response = await protocol.request(request).response
+    
+    if CACHE_ENABLED:
+        responseCache.put(key, response)
+    
+    return response, False
+
+
+# Interfaces whose all-CoAP-nodes group (ff02::fd) is used for discovery and reads, e.g. 'tap0,tap1'
+MULTICAST_INTERFACES = [name for name in os.environ.get('GATEWAY_MULTICAST_INTERFACES', '').split(',') if name]
+
+# Seconds multicast responses are collected, longer than the leisure of the devices
+MULTICAST_LEISURE = float(os.environ.get('GATEWAY_MULTICAST_LEISURE', '2'))
+
+# Seconds between two multicast discoveries
+DISCOVERY_INTERVAL = float(os.environ.get('GATEWAY_DISCOVERY_INTERVAL', '300'))
+
+DEVICE_PORT = 5683
+
+
+def remoteDevice(remote):
+    """Device name of the sender of a response, as used in the resource directory"""
+    host, port = remote.sockaddr[:2]
+    if port == DEVICE_PORT:
+        return host
+    if isIpv6(host):
+        return '[%s]:%d' % (host, port)
+    return '%s:%d' % (host, port)
+
+
+async def multicastGet(protocol, path):
+    """One NON GET to ff02::fd on every multicast interface, responses are collected for MULTICAST_LEISURE.
+    Devices that answered are put in the response cache. Returns { device: response }."""
+    responses = {}
+    
+    async def collect(interface):
+        request = Message(code=GET, mtype=NON, uri='coap://[ff02::fd%' + interface + ']' + path)
+        async for response in protocol.request(request).responses:
+            if response.code.is_successful():
+                responses[remoteDevice(response.remote)] = response
+    
+    try:
+        await asyncio.wait_for(asyncio.gather(*(collect(interface) for interface in MULTICAST_INTERFACES)), MULTICAST_LEISURE)
+    except asyncio.TimeoutError:
+        pass
+    except Exception as e:
+        print('Multicast GET ' + path + ' failed:')
+        print(e)
+    
+    if CACHE_ENABLED:
+        for device, response in responses.items():
+            responseCache.put((device, path, None), response)
+    
+    return responses
+
+
+async def discoverDevices(protocol):
+    """Multicast /.well-known/core and register every node that serves /riot/did.
+    Registrations last three discovery intervals, devices that leave the link expire."""
+    responses = await multicastGet(protocol, '/.well-known/core')
+    
+    for device, response in responses.items():
+        links = parseLinkFormat(response.payload.decode('utf-8'))
+        if '/riot/did' in links and registerDevice(device, device, 3 * DISCOVERY_INTERVAL, links)[1]:
+            print('Discovered device ' + device)
+
+
+async def discoveryLoop(protocol):
+    while True:
+        await discoverDevices(protocol)
+        await asyncio.sleep(DISCOVERY_INTERVAL)
+
+
+class RiotBoard(resource.Resource):
+    async def render_get(self, request):
+        protocol = clientContext
+        
+        # One multicast GET reaches every device of the link, devices that stay silent are asked by unicast
+        multicastResponses = {}
+        if MULTICAST_INTERFACES and not all(responseCache.fresh((device, '/riot/board', None)) for device in directory.endpoints('/riot/board')):
+            multicastResponses = await multicastGet(protocol, '/riot/board')
+        
+        async def askDevice(device):
+            response = multicastResponses.get(device)
+            if response == None:
+                response, _ = await fetchCached(protocol, device, '/riot/board')
+            print('Result: %s\n%r'%(response.code, response.payload))
+            
+            return response.payload.decode('utf-8')
+        
+        allResponses, statuses = await fanOut(askDevice, '/riot/board')
+
+        result = '[' + ','.join(allResponses + statusEntries(statuses)) + ']'
         return aiocoap.Message(payload=result.encode('ascii'))
         
         
+def jsonCompact(obj):
+    return json.dumps(obj, separators=(',', ':'))
+
+
+def bytesToBase64Url(obj):
+    """Turn the byte strings of a CBOR item into the base64url strings of its JSON form"""
+    if isinstance(obj, bytes):
+        return base64UrlEncode(obj).decode('utf-8')
+    if isinstance(obj, dict):
+        return {key: bytesToBase64Url(value) for key, value in obj.items()}
+    if isinstance(obj, list):
+        return [bytesToBase64Url(value) for value in obj]
+    return obj
+
+
+def cborDidToText(document, proof):
+    """Rebuild the "document proof" text of a DID from its CBOR form.
+    The device sends the same maps as in the JSON, so the signed JSON is the compact dump of them."""
+    document = bytesToBase64Url(document)
+    proof = bytesToBase64Url(proof)
+
+    document_encoded = base64UrlEncode(jsonCompact(document).encode('utf-8')).decode('utf-8')
+    header_encoded = base64UrlEncode(jsonCompact(proof['header']).encode('utf-8')).decode('utf-8')
+    payload_encoded = base64UrlEncode(jsonCompact(proof['payload']).encode('utf-8')).decode('utf-8')
+
+    return document_encoded + " " + header_encoded + "." + payload_encoded + "." + proof['signature']
+
+
+def cborDataToText(data):
+    """Rebuild "data_base64url.signature" (or "data_base64url.index.path.signature"
+    for a reading of a signed epoch) of a reading from its CBOR form"""
+    data = bytesToBase64Url(data)
+    data_encoded = base64UrlEncode(jsonCompact(data['payload']).encode('utf-8')).decode('utf-8')
+
+    if 'path' in data:
+        return data_encoded + "." + str(data['index']) + "." + data['path'] + "." + data['signature']
+
+    return data_encoded + "." + data['signature']
+
+
+def payloadToText(payload, contentFormat):
+    """Text form ("document proof [data.signature]") of a /riot/did or /riot/data payload"""
+    if contentFormat == CONTENT_FORMAT_CBOR:
+        items = cbor2.loads(payload)
+        text = cborDidToText(items[0], items[1])
+        if len(items) > 2:
+            text += " " + cborDataToText(items[2])
+        return text
+
+    return payload.decode('utf-8')
+
+
+def coseSign1Decode(cose):
+    """Split a COSE_Sign1 into (protected header, encoded protected header, payload, signature)"""
+    cose = cbor2.loads(cose)
+    if isinstance(cose, cbor2.CBORTag):
+        cose = cose.value
+    
+    protected_encoded, unprotected, payload, signature = cose
+    protected = cbor2.loads(protected_encoded) if protected_encoded else {}
+    
+    return protected, protected_encoded, payload, signature
+
+
+def coseSign1Verify(verifyKey, protected_encoded, payload, signature):
+    """Check the EdDSA signature of a COSE_Sign1 over its Sig_structure"""
+    toBeSigned = cbor2.dumps(["Signature1", protected_encoded, b"", payload])
+    
+    try:
+        verifyKey.verify(signature, toBeSigned)
+        return True
+    except ed25519.BadSignatureError:
+        return False
+
+
+# Pool that runs the Ed25519 checks off the event loop: thread, process or none (GATEWAY_VERIFY_POOL)
+VERIFY_POOL = os.environ.get('GATEWAY_VERIFY_POOL', 'thread')
+
+# Workers of the pool, one per core by default (GATEWAY_VERIFY_WORKERS)
+VERIFY_WORKERS = int(os.environ.get('GATEWAY_VERIFY_WORKERS', os.cpu_count() or 1))
+
+# Executor created in main(), verification runs inline while it is None
+verifyPool = None
+
+
+def createVerifyPool(kind, workers):
+    if kind == 'thread':
+        return concurrent.futures.ThreadPoolExecutor(max_workers=workers, thread_name_prefix='verify')
+    if kind == 'process':
+        return concurrent.futures.ProcessPoolExecutor(max_workers=workers)
+    return None
+
+
+async def verifyInPool(function, *args):
+    """Run a verification function on the verify pool and await its result without blocking the event loop.
+    With a process pool the function and its arguments are pickled, so only module level functions are passed."""
+    if verifyPool == None:
+        return function(*args)
+    return await asyncio.get_running_loop().run_in_executor(verifyPool, functools.partial(function, *args))
+
+
+def verifySignature(verifyKey, signature, message):
+    """Ed25519 check of a raw signature, returns True if it is valid"""
+    try:
+        verifyKey.verify(signature, message)
+        return True
+    except ed25519.BadSignatureError:
+        return False
+
+
+def verifyDiDCose(did):
+    """Verify a DID signed as COSE_Sign1 by its proof key.
+    Returns (did_document in its JSON form, kid, exp) or None if the DID is not valid."""
+    protected, protected_encoded, payload, signature = coseSign1Decode(did)
+    content = cbor2.loads(payload)
+    
+    print(protected, "\n\n", content, "\n\n")
+    
+    if protected.get(COSE_HEADER_ALG) != COSE_ALG_EDDSA:
+        print("Proof algorithm is not EdDSA")
+        return None
+    
+    #------------------VERIFY SIGNATURE OF PROOF WITH PROOF KEY------------------
+    verifyKey = ed25519.VerifyingKey(content['x'])
+    if coseSign1Verify(verifyKey, protected_encoded, payload, signature):
+        print("Proof Signature is valid")
+    else:
+        print("Proof Signature is bad!")
+        return None
+    
+    #------------------VERIFY  EXP AND IAT------------------
+    now = time.time()
+    if not content['iat'] <= now < content['exp']:
+        print("DID is not valid at this time")
+        return None
+    
+    #------------------VERIFY KID AND DID DOCUMENT ID ARE THE THUMBPRINT OF THE PROOF KEY------------------
+    proof_jwk = {"kty": "OKP", "crv": "Ed25519", "x": base64UrlEncode(content['x']).decode('utf-8')}
+    
+    m = hashlib.sha256()
+    m.update(json.dumps(proof_jwk, sort_keys=True, separators=(',', ':')).encode('utf-8'))
+    thumbprint = m.digest()
+    
+    did_document = bytesToBase64Url(content['document'])
+    
+    if protected.get(COSE_HEADER_KID) != thumbprint or did_document['id'] != "did:self:" + base64UrlEncode(thumbprint).decode('utf-8'):
+        print("The proof key does not match the DID")
+        return None
+    
+    return did_document, thumbprint, content['exp']
+
+
+# DIDs verified from COSE_Sign1, per device: { device: VerifiedDid }
+coseDids = {}
+
+
+async def fetchDiDCose(protocol, device):
+    """Fetch and verify the COSE DID of a device, remember it for its data signatures"""
+    request = Message(code=GET, uri=deviceUri(device, '/riot/did'), accept=CONTENT_FORMAT_COSE_SIGN1)
+    response = await protocol.request(request).response
+    
+    verified = await verifiedCoseDid(response.payload)
+    if verified != None:
+        coseDids[device] = verified
+    else:
+        coseDids.pop(device, None)
+    
+    return verified
+
+
+async def verifyDataCose(protocol, device, data):
+    """Verify a reading signed as COSE_Sign1 with the attestation key of the device DID.
+    The kid refers to the DID, which is only fetched again when the kid is unknown."""
+    protected, protected_encoded, payload, signature = coseSign1Decode(data)
+    kid = protected.get(COSE_HEADER_KID, b'')
+    
+    verified = coseDids.get(device)
+    if verified == None or not verified.kid.startswith(kid) or time.time() >= verified.exp:
+        verified = await fetchDiDCose(protocol, device)
+    
+    if verified == None or not verified.kid.startswith(kid):
+        print("INVALID DID FOR DEVICE: " + device)
+        return None
+    
+    if await verifyInPool(coseSign1Verify, verified.verifyKey, protected_encoded, payload, signature):
+        print("Data Signature is valid")
+        return cbor2.loads(payload)
+    
+    print("Data Signature is bad!")
+    return None
+
+
 def verifyDiD(did):
     validDid = True #Return value
     
@@ -134,170 +671,725 @@ def verifyDiD(did):
     
     
     return validDid
+
+
+class VerifiedDid:
+    """A DID that passed verification, with the attestation key that signs the data of its device"""
     
+    def __init__(self, document, exp):
+        self.document = document
+        self.exp = exp
+        self.kid = base64UrlDecode(document['id'][len("did:self:"):].encode('utf-8'))
+        self.attestation = base64UrlDecode(document['attestation']['publicKeyJwk']['x'].encode('utf-8'))
+        self.verifyKey = ed25519.VerifyingKey(self.attestation)
+
+
+class VerifiedDidCache:
+    """DIDs kept until their exp once verified: { (did id, SHA-256 of the raw DID): VerifiedDid }
+    The hash covers the document and the proof, a DID is verified again as soon as any of its bytes change."""
     
-class getDid(resource.Resource):
-    async def render_get(self, request):
-        protocol = await Context.create_client_context()
+    def __init__(self):
+        self.entries = {}
+        self.hits = 0
+        self.misses = 0
+        # Called with every DID that is added
+        self.onPut = None
+    
+    def key(self, didId, raw):
+        return (didId, hashlib.sha256(raw).digest())
+    
+    def get(self, key):
+        entry = self.entries.get(key)
+        if entry != None and time.time() < entry.exp:
+            self.hits += 1
+            return entry
         
-        allResponses = []
+        self.entries.pop(key, None)
+        self.misses += 1
+        return None
+    
+    def put(self, key, did):
+        now = time.time()
+        for expired in [k for k, entry in self.entries.items() if entry.exp <= now]:
+            del self.entries[expired]
+        self.entries[key] = did
         
-        for device in devices['all']:
+        if self.onPut != None:
+            self.onPut(key, did)
+    
+    def stats(self):
+        return {'hits': self.hits, 'misses': self.misses, 'entries': len(self.entries)}
 
-            request = Message(code=GET, uri='coap://[' + device + ']/riot/did')
 
-            try:
-                response = await protocol.request(request).response
-            except Exception as e:
-                print('Failed to fetch resource:')
-                print(e)
+verifiedDids = VerifiedDidCache()
+
+
+async def verifiedTextDid(did):
+    """Verify the "document proof" text of a DID (data may follow) unless it is already verified.
+    Returns the VerifiedDid or None if the DID is not valid."""
+    result = did.split(" ")
+    
+    did_document = base64UrlDecode(result[0].split(".")[0].encode('utf-8'))
+    did_document = json.loads(did_document)
+    
+    key = verifiedDids.key(did_document['id'], (result[0] + " " + result[1]).encode('utf-8'))
+    verified = verifiedDids.get(key)
+    if verified != None:
+        print("DID ALREADY VERIFIED")
+        return verified
+    
+    if not await verifyInPool(verifyDiD, did):
+        return None
+    
+    proof_payload = base64UrlDecode(result[1].split(".")[1].encode('utf-8'))
+    proof_payload = json.loads(proof_payload)
+    
+    verified = VerifiedDid(did_document, proof_payload['exp'])
+    verifiedDids.put(key, verified)
+    return verified
+
+
+async def verifiedCoseDid(did):
+    """Verify a COSE_Sign1 DID unless it is already verified, returns the VerifiedDid or None"""
+    protected = coseSign1Decode(did)[0]
+    didId = "did:self:" + base64UrlEncode(protected.get(COSE_HEADER_KID, b'')).decode('utf-8')
+    
+    key = verifiedDids.key(didId, did)
+    verified = verifiedDids.get(key)
+    if verified != None:
+        print("DID ALREADY VERIFIED")
+        return verified
+    
+    result = await verifyInPool(verifyDiDCose, did)
+    if result == None:
+        return None
+    
+    verified = VerifiedDid(result[0], result[2])
+    verifiedDids.put(key, verified)
+    return verified
+
+
+# Last verified DID of every device with its ETag: { device: (etag, did) }
+didCache = {}
+
+
+class getDid(resource.Resource):
+    async def render_get(self, request):
+        protocol = clientContext
+        
+        async def askDevice(device):
+            # Revalidate the cached DID, the device answers 2.03 Valid without payload if it did not change
+            cached = didCache.get(device)
+            etags = [cached[0]] if cached != None else None
+
+            response, _ = await fetchCached(protocol, device, '/riot/did', DEVICE_FORMAT, etags)
+            print('Result: %s\n%r\n\n'%(response.code, response.payload))
+            
+            if cached != None and (response.code == VALID or response.opt.etag == cached[0]):
+                print("DID NOT MODIFIED")
+                return cached[1]
+            
+            didCache.pop(device, None)
+            
+            if response.opt.content_format == CONTENT_FORMAT_COSE_SIGN1:
+                validDid = await verifiedCoseDid(response.payload) != None
+                did = base64UrlEncode(response.payload).decode('utf-8')
             else:
-                print('Result: %s\n%r\n\n'%(response.code, response.payload))
-                
-                validDid = verifyDiD(response.payload.decode('utf-8'))
-                
-                if validDid:
-                    print("VALID DID")
-                    allResponses.append(response.payload.decode('utf-8'))
-                else:
-                    print("INVALID DID FOR DEVICE: " + device)
+                did = payloadToText(response.payload, response.opt.content_format)
+                validDid = await verifiedTextDid(did) != None
+            
+            if not validDid:
+                print("INVALID DID FOR DEVICE: " + device)
+                return None
+            
+            print("VALID DID")
+            if response.opt.etag != None:
+                didCache[device] = (response.opt.etag, did)
+            
+            return did
+        
+        allResponses, statuses = await fanOut(askDevice, '/riot/did')
                     
-        if len(allResponses) == 0:
+        if len(allResponses) == 0 and len(statuses) == 0:
             return aiocoap.Message(payload="No valid DID found".encode('ascii'))
         else :
-            result = '[' + ','.join(allResponses) + ']'
+            result = '[' + ','.join(allResponses + statusEntries(statuses)) + ']'
             return aiocoap.Message(payload=result.encode('ascii'))
 
 
-def verifyData(response):
+# Last verified epoch root per data key: { public key: root }
+epochRoots = {}
+
+# Readings per epoch of the devices, their CONFIG_DID_DATA_EPOCH_SIZE (GATEWAY_DATA_EPOCH_SIZE, 0 takes the depth
+# of the tree from the path of each reading, up to the 256 readings a device supports)
+DATA_EPOCH_SIZE = int(os.environ.get('GATEWAY_DATA_EPOCH_SIZE', '0'))
+DATA_EPOCH_MAX_DEPTH = 8
+
+
+def merkleRoot(data_string, index, path):
+    """Root of a device epoch tree from a reading, its leaf index and the sibling hashes up to the root.
+    Returns None unless path holds one hash per level of the tree and index is a leaf of it."""
+    if DATA_EPOCH_SIZE > 0:
+        depth = DATA_EPOCH_SIZE.bit_length() - 1
+    else:
+        depth = len(path) // 32
+    
+    if depth < 1 or depth > DATA_EPOCH_MAX_DEPTH or len(path) != 32 * depth or not 0 <= index < 2 ** depth:
+        print("Epoch proof does not match a tree of depth %d" % depth)
+        return None
+    
+    node = hashlib.sha256(b'\x00' + data_string).digest()
+    
+    for i in range(0, len(path), 32):
+        sibling = path[i:i + 32]
+        if index & 1:
+            node = hashlib.sha256(b'\x01' + sibling + node).digest()
+        else:
+            node = hashlib.sha256(b'\x01' + node + sibling).digest()
+        index >>= 1
+    
+    return node
+
+
+async def verifyData(response, did=None):
+    """Verify the data of a "document proof data" response, with the key of the already verified DID if given"""
     validData = None #Return value
     
     result = response.split(" ")
     
-    did_document_encoded = result[0].split(".")     
     data_encoded = result[2].split(".")
     
-    did_document = base64UrlDecode(did_document_encoded[0].encode('utf-8'))
-    did_document = json.loads(did_document)
-    
     data = base64UrlDecode(data_encoded[0].encode('utf-8'))
     data = json.loads(data)
     
-    print(did_document, "\n\n", data, "\n\n")
-    
     
     #------------------VERIFY SIGNATURE OF DATA WITH DID DOCUMENT JWK------------------
     #----------------------------------------------------------------------------------
-    did_document_public_key = base64UrlDecode(did_document['attestation']['publicKeyJwk']['x'].encode('utf-8'))
-    did_document_public_key = base64.b64encode(did_document_public_key)
-    
-    #PROOF JWK PUBLIC KEY
-    verifyKey = ed25519.VerifyingKey(did_document_public_key, encoding="base64")
+    if did != None:
+        print(data, "\n\n")
+        
+        did_document_public_key = did.attestation
+        verifyKey = did.verifyKey
+    else:
+        did_document = base64UrlDecode(result[0].split(".")[0].encode('utf-8'))
+        did_document = json.loads(did_document)
+        
+        print(did_document, "\n\n", data, "\n\n")
+        
+        did_document_public_key = base64UrlDecode(did_document['attestation']['publicKeyJwk']['x'].encode('utf-8'))
+        
+        #PROOF JWK PUBLIC KEY
+        verifyKey = ed25519.VerifyingKey(did_document_public_key)
     
     #SIGNATURE OF PROOF HEADER + PROOF PAYLOAD SPEPARATED BY A DOT
-    signature = base64UrlDecode(data_encoded[1].encode('utf-8'))
-    signature = base64.b64encode(signature)
+    signature = base64UrlDecode(data_encoded[-1].encode('utf-8'))
     
     #STRING OF PROOF HEADER + PROOF PAYLOAD SPEPARATED BY A DOT WHICH WE WANT TO VERIFY
     data_string = data_encoded[0]
     data_string = data_string.encode('utf-8')
+    
+    #------------------READING OF A SIGNED EPOCH: THE SIGNATURE COVERS THE MERKLE ROOT------------------
+    if len(data_encoded) == 4:
+        path = base64UrlDecode(data_encoded[2].encode('utf-8')) if data_encoded[2] else b''
+        data_string = merkleRoot(data_string, int(data_encoded[1]), path) if data_encoded[1].isdigit() else None
+        
+        if data_string == None:
+            print("Data Signature is bad!")
+            return None
+        if epochRoots.get(did_document_public_key) == data_string:
+            print("Data is in a verified epoch")
+            return data
             
-    try:
-        verifyKey.verify(signature, data_string, encoding="base64") #TODO SIGNATURE IS TOO BIG???
+    if await verifyInPool(verifySignature, verifyKey, signature, data_string):
         print("Data Signature is valid")
         validData = data
-    except:
+        
+        if len(data_encoded) == 4:
+            epochRoots[did_document_public_key] = data_string
+    else:
         print("Data Signature is bad!")
         
     return validData
     
     
     
-class getData(resource.Resource):
-    async def render_get(self, request):
-        protocol = await Context.create_client_context()
+async def verifyDataResponse(protocol, device, response):
+    """Verify a /riot/data response or notification of a device, returns the reading or None"""
+    if response.opt.content_format == CONTENT_FORMAT_COSE_SIGN1:
+        # Validate DATA, the DID is only fetched and validated when its kid is unknown
+        validData = await verifyDataCose(protocol, device, response.payload)
+    else:
+        payload = payloadToText(response.payload, response.opt.content_format)
+        
+        # Validate DID, a DID verified before is only looked up
+        did = await verifiedTextDid(payload)
         
-        allResponses = []
+        if did != None:
+            print("VALID DID")
+        else:
+            print("INVALID DID FOR DEVICE: " + device)
         
-        for device in devices['all']:
+        # Validate DATA
+        validData = await verifyData(payload, did)
+    
+    if validData != None:
+        print("VALID DATA")
+    else:
+        print("INVALID DATA")
+    
+    return validData
 
-            request = Message(code=GET, uri='coap://[' + device + ']/riot/data')
 
-            try:
-                response = await protocol.request(request).response
-            except Exception as e:
-                print('Failed to fetch resource:')
-                print(e)
-            else:
-                print('Result: %s\n%r\n\n'%(response.code, response.payload))
-                
-                # Validate DID
-                validDid = verifyDiD(response.payload.decode('utf-8'))
-                
-                if validDid:
-                    print("VALID DID")
+# Seconds before a lost observation is registered again
+OBSERVE_RETRY = 30
+
+# Latest verified reading of every observed device: { device: reading }
+observedData = {}
+
+# Readings of the last run, served until they expire or their device answers again: { device: (reading, expires) }
+warmData = {}
+
+# One observation of /riot/data per device: { device: task }
+observations = {}
+
+
+
+async def observeDevice(protocol, device):
+    """Observe /riot/data of a device and keep its latest verified notification"""
+    while True:
+        request = Message(code=GET, uri=deviceUri(device, '/riot/data'), observe=0, accept=DEVICE_FORMAT)
+        
+        try:
+            pr = protocol.request(request)
+            
+            response = await pr.response
+            observedData[device] = await verifyDataResponse(protocol, device, response)
+            rememberData(device, observedData[device])
+            
+            async for response in pr.observation:
+                print('Notification: %s\n%r\n\n'%(response.code, response.payload))
+                observedData[device] = await verifyDataResponse(protocol, device, response)
+                rememberData(device, observedData[device])
+        except Exception as e:
+            print('Observation of ' + device + ' failed:')
+            print(e)
+        
+        observedData.pop(device, None)
+        await asyncio.sleep(OBSERVE_RETRY)
+
+
+def startObservation(protocol, device):
+    if device not in observations:
+        observations[device] = asyncio.create_task(observeDevice(protocol, device))
+
+
+def stopObservation(device):
+    task = observations.pop(device, None)
+    if task != None:
+        task.cancel()
+    observedData.pop(device, None)
+    warmData.pop(device, None)
+
+
+class getData(resource.Resource):
+    async def render_get(self, request):
+        protocol = clientContext
+        
+        async def askDevice(device):
+            # Served from the latest verified notification while the device is observed,
+            # or from the reading of the last run until it expires
+            validData = observedData.get(device)
+            
+            warm = warmData.get(device)
+            if validData == None and warm != None:
+                if time.time() < warm[1]:
+                    validData = warm[0]
                 else:
-                    print("INVALID DID FOR DEVICE: " + device)
-                
-                # Validate DATA
-                validData = verifyData(response.payload.decode('utf-8'))
+                    warmData.pop(device, None)
+            
+            if validData == None:
+                response, _ = await fetchCached(protocol, device, '/riot/data', DEVICE_FORMAT)
+                print('Result: %s\n%r\n\n'%(response.code, response.payload))
                 
-                if validData != None:
-                    print("VALID DATA")
-                    allResponses.append(json.dumps(validData, separators=(',', ':')))
-                else:
-                    print("INVALID DATA")
+                validData = await verifyDataResponse(protocol, device, response)
+                rememberData(device, validData)
+            
+            if validData == None:
+                return None
+            return json.dumps(validData, separators=(',', ':'))
+        
+        allResponses, statuses = await fanOut(askDevice, '/riot/data')
                 
-        if len(allResponses) == 0:
+        if len(allResponses) == 0 and len(statuses) == 0:
             return aiocoap.Message(payload="No valid DATA found".encode('ascii'))
         else :
-            result = '[' + ','.join(allResponses) + ']'
+            result = '[' + ','.join(allResponses + statusEntries(statuses)) + ']'
             return aiocoap.Message(payload=result.encode('ascii'))
 
 
 
 class wellknown(resource.Resource):
     async def render_get(self, request):
-        protocol = await Context.create_client_context()
+        protocol = clientContext
         
-        allResponses = []
+        async def askDevice(device):
+            response, _ = await fetchCached(protocol, device, '/.well-known/core')
+            print('Result: %s\n%r'%(response.code, response.payload))
+            
+            return response.payload.decode('utf-8')
         
-        for device in devices['all']:
-
-            request = Message(code=GET, uri='coap://[' + device + ']/.well-known/core')
-
-            try:
-                response = await protocol.request(request).response
-            except Exception as e:
-                print('Failed to fetch resource:')
-                print(e)
-            else:
-                print('Result: %s\n%r'%(response.code, response.payload))
-                
-                allResponses.append(response.payload.decode('utf-8'))
+        allResponses, statuses = await fanOut(askDevice)
+        
+        # Devices that did not answer are listed as links with their status
+        allResponses += ['<%s>;status="%s"' % (deviceUri(device, ''), status) for device, status in statuses.items()]
         
         if len(allResponses) == 0:
             return aiocoap.Message(payload="No Devices were found".encode('ascii'))
         else :
-            result = ''.join(allResponses)
+            result = ','.join(allResponses)
             return aiocoap.Message(payload=result.encode('ascii'))
         
         
+class cacheStats(resource.Resource):
+    async def render_get(self, request):
+        stats = responseCache.stats()
+        stats['dids'] = verifiedDids.stats()
+        return aiocoap.Message(payload=json.dumps(stats).encode('ascii'))
+
+
+class RetransmissionCounter(logging.Handler):
+    """Counts the retransmissions of confirmable messages that aiocoap logs"""
+    
+    def __init__(self):
+        super().__init__()
+        self.count = 0
+    
+    def emit(self, record):
+        if record.getMessage().startswith('Retransmission'):
+            self.count += 1
+
+
+retransmissions = RetransmissionCounter()
+
+
+class gatewayStats(resource.Resource):
+    async def render_get(self, request):
+        stats = {
+            'devices': len(directory.lookup()),
+            'observations': len(observations),
+            'retransmissions': retransmissions.count,
+            'cache': responseCache.stats(),
+            'dids': verifiedDids.stats(),
+        }
+        return aiocoap.Message(payload=json.dumps(stats).encode('ascii'))
+
+
+# Resource tree of the gateway, created in main(); registrations are added to it as /rd/<location>
+site = None
+
+# Seconds between two checks for expired registrations
+RD_EXPIRY_CHECK = 10
+
+
+def registerDevice(ep, device, lifetime, links, location=None):
+    """Register a device in the resource directory and observe its data if it serves /riot/data.
+    Returns (Registration, True if it is new)."""
+    existing = directory.locations.get(ep)
+    previous = directory.registrations[existing].device if existing != None else None
+    
+    registration, created = directory.register(ep, device, lifetime, links, location)
+    
+    if created and site != None:
+        site.add_resource(['rd', registration.location], rdRegistration(registration.location))
+    if previous != None and previous != device:
+        stopObservation(previous)
+    if links == None or '/riot/data' in links:
+        startObservation(clientContext, device)
+    
+    return registration, created
+
+
+def registrationRemoved(registration):
+    if stateStore != None:
+        stateStore.delete('registrations', registration.ep)
+    if site != None:
+        site.remove_resource(['rd', registration.location])
+    if not any(other.device == registration.device for other in directory.registrations.values()):
+        stopObservation(registration.device)
+
+
+directory.onRemove = registrationRemoved
+
+
+async def expiryLoop():
+    while True:
+        directory.expire()
+        await asyncio.sleep(RD_EXPIRY_CHECK)
+
+
+def queryParameters(request):
+    return dict(query.split('=', 1) for query in request.opt.uri_query if '=' in query)
+
+
+def baseDevice(base):
+    """Device name of the base URI of a registration, e.g. coap://[fe80::1%25tap0], coap://[::1]:5684
+    or coap://192.0.2.1"""
+    authority = base.split('://', 1)[-1].split('/', 1)[0].replace('%25', '%')
+    if authority.endswith(']'):
+        return authority[1:-1]
+    if authority.endswith(':%d' % DEVICE_PORT):
+        authority = authority[:authority.rindex(':')]
+        return authority[1:-1] if authority.startswith('[') else authority
+    return authority
+
+
+def queryLifetime(query):
+    """Lifetime in seconds of an lt= query parameter, None if it is missing, raises ValueError if it is malformed"""
+    if 'lt' not in query:
+        return None
+    if not query['lt'].isdigit() or int(query['lt']) == 0:
+        raise ValueError('lt must be a positive number of seconds')
+    return int(query['lt'])
+
+
+class rdRegister(resource.Resource):
+    """Registration interface of the resource directory (RFC 9176 5.3):
+    POST /rd?ep=name[&lt=seconds][&base=uri] with the links of the device in link-format"""
+    async def render_post(self, request):
+        query = queryParameters(request)
+        if 'ep' not in query:
+            return aiocoap.Message(code=BAD_REQUEST, payload="ep is required".encode('ascii'))
+        
+        try:
+            lifetime = queryLifetime(query)
+        except ValueError as e:
+            return aiocoap.Message(code=BAD_REQUEST, payload=str(e).encode('ascii'))
+        
+        device = baseDevice(query['base']) if 'base' in query else remoteDevice(request.remote)
+        links = parseLinkFormat(request.payload.decode('utf-8'))
+        
+        registration, created = registerDevice(query['ep'], device, lifetime if lifetime != None else RD_DEFAULT_LIFETIME, links)
+        print('Registered ' + query['ep'] + ' at /rd/' + registration.location)
+        
+        return aiocoap.Message(code=CREATED, location_path=['rd', registration.location])
+
+
+class rdRegistration(resource.Resource):
+    """Registration resource /rd/<location>: POST refreshes it (lt, new links if any), DELETE removes it"""
+    def __init__(self, location):
+        super().__init__()
+        self.location = location
+    
+    async def render_post(self, request):
+        query = queryParameters(request)
+        try:
+            lifetime = queryLifetime(query)
+        except ValueError as e:
+            return aiocoap.Message(code=BAD_REQUEST, payload=str(e).encode('ascii'))
+        links = parseLinkFormat(request.payload.decode('utf-8')) if request.payload else None
+        
+        registration = directory.update(self.location, lifetime, links)
+        if registration == None:
+            return aiocoap.Message(code=NOT_FOUND)
+        
+        if links != None and '/riot/data' in links:
+            startObservation(clientContext, registration.device)
+        return aiocoap.Message(code=CHANGED)
+    
+    async def render_delete(self, request):
+        directory.remove(self.location)
+        return aiocoap.Message(code=DELETED)
+
+
+class rdLookupEndpoints(resource.Resource):
+    """Endpoint lookup (RFC 9176 6.2): the live registrations"""
+    async def render_get(self, request):
+        result = ','.join('<%s>;ep="%s";lt=%d' % (deviceUri(registration.device, ''), registration.ep, registration.lifetime)
+                          for registration in directory.lookup())
+        return aiocoap.Message(payload=result.encode('utf-8'), content_format=40)
+
+
+class rdLookupResources(resource.Resource):
+    """Resource lookup (RFC 9176 6.2): links of the registered devices, filtered with ?href= or ?rt="""
+    async def render_get(self, request):
+        query = queryParameters(request)
+        resourceFilter = query.get('href', query.get('rt'))
+        
+        result = []
+        for registration in directory.lookup(resourceFilter):
+            for target, types in (registration.links or {}).items():
+                if resourceFilter == None or resourceFilter == target or resourceFilter in types:
+                    result.append('<%s>;anchor="%s"' % (deviceUri(registration.device, target), deviceUri(registration.device, '')))
+        
+        return aiocoap.Message(payload=','.join(result).encode('utf-8'), content_format=40)
+
+
 class newDevice(resource.Resource):
     async def render_post(self, request):
         newDeviceJson = json.loads(request.payload.decode('utf-8'))
         
-        devices['all'].append(newDeviceJson['ipv6']+'%'+newDeviceJson['interface'])
-        print(devices)
-        return aiocoap.Message(payload="success".encode('ascii'))
+        device = newDeviceJson['ipv6']+'%'+newDeviceJson['interface']
         
+        # Register the device with its links, if it does not answer it is asked for every resource
+        links = None
+        try:
+            response, _ = await asyncio.wait_for(fetchCached(clientContext, device, '/.well-known/core'), DEVICE_TIMEOUT)
+            links = parseLinkFormat(response.payload.decode('utf-8'))
+        except Exception as e:
+            print('Links of ' + device + ' are unknown:')
+            print(e)
+        
+        registerDevice(device, device, RD_DEFAULT_LIFETIME, links)
+        
+        return aiocoap.Message(payload="success".encode('ascii'))
+
+
+# SQLite file that keeps the registry, the verified DIDs and the last data across restarts (GATEWAY_STATE_DB, empty disables it)
+STATE_DB = os.environ.get('GATEWAY_STATE_DB', 'gateway_state.sqlite3')
+
+# Seconds between two write-behind flushes of the state
+STATE_FLUSH = float(os.environ.get('GATEWAY_STATE_FLUSH', '5'))
+
+# Seconds a stored reading is served after a restart, until its device answers again
+WARM_DATA_MAX_AGE = float(os.environ.get('GATEWAY_WARM_DATA_MAX_AGE', '600'))
+
+STATE_TABLES = ('registrations', 'dids', 'data')
+
+
+class StateStore:
+    """Write-behind copy of the gateway state in SQLite: every table is { key: (CBOR value, expires) }.
+    Changes are collected in memory and written in one transaction per flush, off the event loop."""
+    
+    def __init__(self, path):
+        self.connection = sqlite3.connect(path, check_same_thread=False)
+        with self.connection:
+            for table in STATE_TABLES:
+                self.connection.execute('CREATE TABLE IF NOT EXISTS %s (key PRIMARY KEY, value BLOB, expires REAL)' % table)
+        # Changes not written yet: { (table, key): (value, expires) or None to delete }
+        self.pending = {}
+        # One writer thread keeps the transactions in order, the lock one flush at a time
+        self.writer = concurrent.futures.ThreadPoolExecutor(max_workers=1)
+        self.flushing = asyncio.Lock()
+    
+    def put(self, table, key, value, expires):
+        self.pending[(table, key)] = (cbor2.dumps(value), expires)
+    
+    def delete(self, table, key):
+        self.pending[(table, key)] = None
+    
+    def load(self, table):
+        """Rows of a table that did not expire, as (key, value, expires); expired rows are dropped"""
+        now = time.time()
+        with self.connection:
+            self.connection.execute('DELETE FROM %s WHERE expires <= ?' % table, (now,))
+        return [(key, cbor2.loads(value), expires) for key, value, expires in
+                self.connection.execute('SELECT key, value, expires FROM %s' % table)]
+    
+    def write(self, pending):
+        with self.connection:
+            for (table, key), row in pending.items():
+                if row == None:
+                    self.connection.execute('DELETE FROM %s WHERE key = ?' % table, (key,))
+                else:
+                    self.connection.execute('INSERT OR REPLACE INTO %s VALUES (?, ?, ?)' % table, (key,) + row)
+    
+    async def flush(self):
+        async with self.flushing:
+            pending = dict(self.pending)
+            if not pending:
+                return
+            await asyncio.get_running_loop().run_in_executor(self.writer, self.write, pending)
+            # Drop only what was committed, a key changed during the write stays pending
+            for item, row in pending.items():
+                if item in self.pending and self.pending[item] is row:
+                    del self.pending[item]
+    
+    def close(self):
+        # Waits for a write that is still running, e.g. of a cancelled flush
+        self.writer.shutdown(wait=True)
+        self.connection.close()
+
+
+# Created in main() unless GATEWAY_STATE_DB is empty
+stateStore = None
+
+
+def registrationChanged(registration):
+    if stateStore != None:
+        stateStore.put('registrations', registration.ep,
+                       {'location': registration.location, 'device': registration.device, 'links': registration.links},
+                       time.time() + registration.expires - time.monotonic())
+
+
+def didVerified(key, did):
+    if stateStore != None:
+        stateStore.put('dids', cbor2.dumps(list(key)), did.document, did.exp)
+
+
+def rememberData(device, reading):
+    """Keep the last verified reading of a device for a warm restart"""
+    if reading == None:
+        return
+    warmData.pop(device, None)
+    if stateStore != None:
+        stateStore.put('data', device, reading, time.time() + WARM_DATA_MAX_AGE)
+
+
+directory.onChange = registrationChanged
+verifiedDids.onPut = didVerified
+
+
+def restoreState(store):
+    """Load the verified DIDs, the recent readings and the registry of the last run.
+    Readings are served until they expire or their device answers with a new one."""
+    for key, document, exp in store.load('dids'):
+        verifiedDids.entries[tuple(cbor2.loads(key))] = VerifiedDid(document, exp)
+    
+    for device, reading, expires in store.load('data'):
+        warmData[device] = (reading, expires)
+    
+    now = time.time()
+    registrations = store.load('registrations')
+    for ep, registration, expires in registrations:
+        registerDevice(ep, registration['device'], expires - now, registration['links'], registration['location'])
+    
+    print('Restored %d registrations, %d verified DIDs and %d readings' % (
+        len(registrations), len(verifiedDids.entries), len(warmData)))
+
+
+async def revalidateDevices(protocol):
+    """Fetch the DID of every restored device in the background, an unchanged DID is found in the verified DIDs"""
+    async def askDevice(device):
+        response, _ = await fetchCached(protocol, device, '/riot/did', DEVICE_FORMAT)
         
+        if response.opt.content_format == CONTENT_FORMAT_COSE_SIGN1:
+            verified = await verifiedCoseDid(response.payload)
+        else:
+            verified = await verifiedTextDid(payloadToText(response.payload, response.opt.content_format))
         
+        if verified == None:
+            print("INVALID DID FOR DEVICE: " + device)
+        return verified
+    
+    results, statuses = await fanOut(askDevice, '/riot/did')
+    print('Revalidated %d devices, %d did not answer' % (len(results), len(statuses)))
+
+
+async def stateFlushLoop(store):
+    while True:
+        await asyncio.sleep(STATE_FLUSH)
+        try:
+            await store.flush()
+        except sqlite3.Error as e:
+            print('State not written, retrying on the next flush: ' + str(e))
+
+
 
 # logging setup
 
 logging.basicConfig(level=logging.INFO)
 logging.getLogger("coap-server").setLevel(logging.DEBUG)
+logging.getLogger().addHandler(retransmissions)
 
 async def main():
     # Resource tree creation
@@ -310,11 +1402,65 @@ async def main():
     root.add_resource(['riot','data'], getData())
     root.add_resource(['.well-known','core'], wellknown())
     root.add_resource(['newdevice'], newDevice())
+    root.add_resource(['gateway','cache'], cacheStats())
+    root.add_resource(['gateway','stats'], gatewayStats())
+    root.add_resource(['rd'], rdRegister())
+    root.add_resource(['rd-lookup','ep'], rdLookupEndpoints())
+    root.add_resource(['rd-lookup','res'], rdLookupResources())
 
 
-    await aiocoap.Context.create_server_context(root)
-    # Run forever
-    await asyncio.get_running_loop().create_future()
+    server = await aiocoap.Context.create_server_context(root)
+    
+    global clientContext, verifyPool, site, stateStore
+    site = root
+    clientContext = await Context.create_client_context()
+    verifyPool = createVerifyPool(VERIFY_POOL, VERIFY_WORKERS)
+    
+    # Warm start from the state of the last run, the devices are asked again in the background
+    background = []
+    if STATE_DB:
+        stateStore = StateStore(STATE_DB)
+        restoreState(stateStore)
+        background.append(asyncio.create_task(revalidateDevices(clientContext)))
+        background.append(asyncio.create_task(stateFlushLoop(stateStore)))
+    
+    # Observe /riot/data of every registered device instead of polling it
+    for device in directory.endpoints('/riot/data'):
+        startObservation(clientContext, device)
+    
+    expiry = asyncio.create_task(expiryLoop())
+    
+    # Devices that join the link are found with multicast /.well-known/core
+    discovery = None
+    if MULTICAST_INTERFACES:
+        discovery = asyncio.create_task(discoveryLoop(clientContext))
+    
+    # Run until SIGINT or SIGTERM, then shut everything down
+    loop = asyncio.get_running_loop()
+    stop = loop.create_future()
+    for sig in (signal.SIGINT, signal.SIGTERM):
+        loop.add_signal_handler(sig, lambda: stop.done() or stop.set_result(None))
+    
+    try:
+        await stop
+    finally:
+        expiry.cancel()
+        if discovery != None:
+            discovery.cancel()
+        for task in background + list(observations.values()):
+            task.cancel()
+        await asyncio.gather(*background, *observations.values(), return_exceptions=True)
+        
+        if stateStore != None:
+            # The lock waits for the flush in flight, the writer for a write left by a cancelled one
+            await stateStore.flush()
+            stateStore.close()
+        
+        await clientContext.shutdown()
+        await server.shutdown()
+        
+        if verifyPool != None:
+            verifyPool.shutdown()
 
 if __name__ == "__main__":
     asyncio.run(main())
\ No newline at end of file